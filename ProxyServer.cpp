@@ -1,4 +1,9 @@
 #include "ProxyServer.h"
+#include "RelayState.h"
+#include "RelayShard.h"
+#include "RelayBatch.h"
+#include "RelayQueue.h"
+#include "RelayCoalesce.h"
 #include "Log.h"
 #include "Utility.h"
 #include "BitStream.h"
@@ -6,10 +11,10 @@
 
 #include "RakPeerInterface.h"
 #include "RakNetworkFactory.h"
-#include "RakSleep.h"
 #include "MessageIdentifiers.h"
 #include "NatPunchthroughClient.h"
 #include "SocketLayer.h"
+#include "GetTime.h"
 
 #ifdef WIN32
 #include <stdio.h>
@@ -26,29 +31,28 @@
 #include <map>
 #include <stdlib.h>
 #include <list>
-#include <queue>
-#include <bitset>
+#include <vector>
 #include <algorithm>
-
-typedef std::list<RelayItem> RelayQueue;
-typedef std::map<SystemAddress, SystemAddress> RelayMap;
-typedef std::map<int, SystemAddress> ServerMap;
-typedef std::list<int> ServerPorts;
+#include <bitset>
 
 RakPeerInterface *peer;
 bool quit;
-ServerPorts serverPorts;
-ServerPorts usedPorts;
-ServerMap serverMap;
-RelayMap relayMap;
-RelayQueue queue;
+// Client to server relays, see RelayState.h
+RelayState relayState;
+// Messages for servers the proxy is still connecting to
+RelayQueue relayQueue;
+// Relay ports, split across shardCount peers or all served by the main peer, see RelayShard.h
+RelayShard *shards;
+int shardCount;
+// Shard holding the relay port of each server
+AddressTable<RelayShard> serverShards;
+// Client relays for servers accepting batches, sent once every waiting packet is handled
+RelayBatcher batcher;
+// Server relays of state updates to congested clients, enabled with -k
+RelayCoalescer coalescer;
 NatPunchthroughClient natPunchthrough;
 SystemAddress facilitatorAddress = UNASSIGNED_SYSTEM_ADDRESS;
 
-//MRB 8.27.12 -- list of peers and which port they are using, so we can disconnect them if the port owner disconnects
-typedef std::list<PortUser> PortUsers;
-PortUsers portUsers;
-
 char* logfile = "proxyserver.log";
 const int fileBufSize = 1024;
 char pidFile[fileBufSize];
@@ -70,9 +74,57 @@ void usage()
 		   "-r\tRange of ports for proxied servers\n\t"
 		   "-f\tFacilitator address(IP:port)\n\t"
 		   "-i\tPassword for all connections\n\t"
+		   "-t\tReceive thread count, 0 for one thread per port (default). Linux only\n\t"
+		   "-u\tUpdate thread count, threads helping each peer update its connections. 0 to update from the network thread only (default)\n\t"
+		   "-s\tRelay shard count, each shard serves part of the relay ports with its own peer and thread. 0 to serve all ports from the listen port peer (default)\n\t"
+		   "-k\tState update key length, the bytes after ID_STATE_UPDATE naming the object. Unreliable updates to congested clients are coalesced per object. 0 to relay every update (default)\n\t"
 		   "If any parameter is omitted the default value is used.\n");
 }
 
+void WriteRelayHeader(RakNet::BitStream &header, const SystemAddress &sender, unsigned short sessionId)
+{
+	if (sessionId != 0)
+	{
+		header.Write((unsigned char)ID_PROXY_SESSION_MESSAGE);
+		header.Write(sessionId);
+	}
+	else
+	{
+		header.Write((unsigned char)ID_PROXY_MESSAGE);
+		header.Write(sender);
+	}
+}
+
+// Proxy protocol version the server announced in ID_PROXY_SERVER_INIT, 0 if it did not register with the proxy
+int GetServerProtocolVersion(const SystemAddress &server)
+{
+	RelayShard *shard = serverShards.Get(server);
+	return shard ? shard->GetProtocolVersion(server) : 0;
+}
+
+// Session ID to relay the messages of a client relaying through the listen port with, 0 if the server uses addresses
+unsigned short GetClientSession(const SystemAddress &client, int protocolVersion)
+{
+	if (protocolVersion < PROXY_SESSION_PROTOCOL_VERSION)
+		return 0;
+	return relayState.GetClientSession(client);
+}
+
+// Client holding a session ID of this server, and the peer it is connected to. Returns false if the ID is not in use
+bool GetSessionClient(const SystemAddress &server, unsigned short id, SystemAddress *client, RakPeerInterface **sender)
+{
+	if (relayState.OwnsSession(id))
+	{
+		*sender = peer;
+		return relayState.GetSessionAddress(id, client);
+	}
+	RelayShard *shard = serverShards.Get(server);
+	if (shard == 0 || !shard->OwnsSession(id))
+		return false;
+	*sender = shard->GetPeer();
+	return shard->GetSessionAddress(id, client);
+}
+
 void MsgClientInit(Packet *packet, SystemAddress targetAddress, char *password, int passwordLength, bool useNat, int clientVersion)
 {
 
@@ -92,7 +144,6 @@ void MsgClientInit(Packet *packet, SystemAddress targetAddress, char *password,
 		}
 
 		// New packet will be ID(1) + SystemAddress(6)  + ID(1) + proxy version(4) + client version(4) = 16 bytes
-		RelayItem item;
 		RakNet::BitStream stream;
 		stream.Write((unsigned char)ID_PROXY_MESSAGE);
 		stream.Write(packet->systemAddress);
@@ -108,20 +159,28 @@ void MsgClientInit(Packet *packet, SystemAddress targetAddress, char *password,
 			}
 			printf("\n");
 		}
-		item.packet = new char[stream.GetNumberOfBytesUsed()];
-		memcpy(item.packet, stream.GetData(), stream.GetNumberOfBytesUsed());
-		item.length = stream.GetNumberOfBytesUsed();
-		item.target = targetAddress;
-
-		queue.push_back(item);
+		char *queued = relayQueue.Add(targetAddress, stream.GetNumberOfBytesUsed(), RELIABLE_ORDERED, 0, RakNet::GetTime());
+		if (queued)
+			memcpy(queued, stream.GetData(), stream.GetNumberOfBytesUsed());
+		else
+			Log::error_log("Relay queue for %s is full, dropped client init\n", targetAddress.ToString());
 		Log::print_log("Target address %s, not connected. Sending connect request.\n", targetAddress.ToString());
 		return;
 	}
 	else
 	{
+		unsigned short sessionId = GetClientSession(packet->systemAddress, GetServerProtocolVersion(targetAddress));
+		if (sessionId != 0)
+		{
+			RakNet::BitStream init;
+			init.Write((unsigned char)ID_PROXY_SESSION_INIT);
+			init.Write(sessionId);
+			init.Write(packet->systemAddress);
+			peer->Send(&init, HIGH_PRIORITY, RELIABLE_ORDERED, 0, targetAddress, false);
+		}
+
 		RakNet::BitStream stream;
-		stream.Write((unsigned char)ID_PROXY_MESSAGE);
-		stream.Write(packet->systemAddress);
+		WriteRelayHeader(stream, packet->systemAddress, sessionId);
 		stream.Write((unsigned char)ID_REQUEST_CLIENT_INIT);
 		stream.Write((int)PROXY_SERVER_PROTOCOL_VERSION);
 		stream.Write(clientVersion);
@@ -133,7 +192,7 @@ void MsgClientInit(Packet *packet, SystemAddress targetAddress, char *password,
 	}
 }
 
-void MsgClientRelay(RakNet::BitStream &bitStream, Packet *packet, SystemAddress targetAddress)
+void MsgClientRelay(Packet *packet, SystemAddress targetAddress)
 {
 	// If target address is not connected to us (the proxy), then we need to connect first
 	if (!peer->IsConnected(targetAddress))
@@ -144,44 +203,225 @@ void MsgClientRelay(RakNet::BitStream &bitStream, Packet *packet, SystemAddress
 		// Current bitstream has ID(1) + SystemAddress(6) + int(4) = 11 prepended bytes
 		// New will prepend a proxy relay message ID(1) + SystemAddress(6) of sender = 7 prepended bytes
 		// Total message size thus decreases by 11 - 7 = 4 bytes
-		RelayItem item;
-		item.packet = new char[packet->length-4];
-		item.packet[0] = ID_PROXY_MESSAGE;
-		memcpy(item.packet+1, (void*)(&packet->systemAddress), 6);
-		memcpy(item.packet+7, packet->data+11, packet->length-11);
-		item.length = packet->length-4;
-		item.target = targetAddress;
-
-		queue.push_back(item);
+		RakNet::BitStream header;
+		WriteRelayHeader(header, packet->systemAddress, 0);
+		int headerLength = header.GetNumberOfBytesUsed();
+		char *queued = relayQueue.Add(targetAddress, headerLength + packet->length - 11, packet->reliability, packet->orderingChannel, RakNet::GetTime());
+		if (queued == 0)
+		{
+			char tmp[32];
+			strcpy(tmp, packet->systemAddress.ToString());
+			Log::error_log("Relay queue for %s is full, dropped message from %s\n", targetAddress.ToString(), tmp);
+			return;
+		}
+		memcpy(queued, header.GetData(), headerLength);
+		memcpy(queued + headerLength, packet->data + 11, packet->length - 11);
 		Log::print_log("Target address %s, not connected. Sending connect request.\n", targetAddress.ToString());
 	}
 	else
 	{
-		// Now we need to prepend proxy message ID + sender address to original message
-		// packet struct).
-		RakNet::BitStream stream;
-		stream.Write((unsigned char)ID_PROXY_MESSAGE);
-		stream.Write(packet->systemAddress);
-		stream.WriteBits(bitStream.GetData()+1, bitStream.GetNumberOfBitsUsed()-8, false);
-
-		peer->Send(&stream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, targetAddress, false);
+		// Now we need to prepend proxy message ID + sender address or session ID to original message
+		// packet struct). The message itself is sent from the packet without copying it, with the reliability the client used
+		int protocolVersion = GetServerProtocolVersion(targetAddress);
+		RakNet::BitStream header;
+		WriteRelayHeader(header, packet->systemAddress, GetClientSession(packet->systemAddress, protocolVersion));
+
+		if (protocolVersion >= PROXY_BATCH_PROTOCOL_VERSION &&
+			batcher.Add(peer, targetAddress, (const char*)header.GetData(), header.GetNumberOfBytesUsed(), packet->data+1, packet->length-1, packet->reliability, packet->orderingChannel))
+			return;
+		peer->SendWithHeader((const char*)header.GetData(), header.GetNumberOfBytesUsed(), packet, 1, packet->length-1, HIGH_PRIORITY, packet->reliability, packet->orderingChannel, targetAddress, false);
 		char tmpip[32];
 		strcpy(tmpip, packet->systemAddress.ToString());
 		//Log::print_log("Proxying relay message to server at %s, sender is %s\n", targetAddress.ToString(), tmpip);
 	}
 }
 
-void MsgClientRelayPassthrough(RakNet::BitStream &bitStream, Packet *packet, SystemAddress targetAddress)
+// Relay a message from a server to one of its clients. The message is the length bytes of packet data from offset on,
+// which is the whole packet unless it came in a batch
+void MsgServerRelay(Packet *packet, int offset, int length)
 {
-	// Now we need to prepend proxy message ID + sender address to original message
-	RakNet::BitStream stream;
-	stream.Write((unsigned char)ID_PROXY_MESSAGE);
-	stream.Write(packet->systemAddress);
-	stream.WriteBits(bitStream.GetData(), bitStream.GetNumberOfBitsUsed(), false);
+	// ID(1) + SystemAddress(6)
+	if (length <= 7)
+	{
+		Log::error_log("Malformed relay message from server at %s\n", packet->systemAddress.ToString());
+		return;
+	}
+	SystemAddress clientAddress;
+	RakNet::BitStream bitStream(packet->data + offset, length, false);
+	bitStream.IgnoreBits(8); // Ignore the ID_...
+
+	// To what client should this message be relayed to
+	bitStream.Read(clientAddress);
+
+	// Forward the message after the 7 byte relay header. Clients of a relay port are connected to the shard of the port,
+	// clients relaying through the listen port are connected to the main peer
+	RakPeerInterface *sender = peer;
+	RelayShard *shard = serverShards.Get(packet->systemAddress);
+	if (shard && shard->GetPeer()->IsConnected(clientAddress))
+		sender = shard->GetPeer();
+	if (!coalescer.Add(sender, clientAddress, packet->data, offset + 7, length - 7, packet->reliability, packet->orderingChannel, RakNet::GetTime()))
+		RelayShard::Forward(peer, sender, 0, 0, packet, offset + 7, length - 7, clientAddress);
+
+	if (Log::sDebugLevel >= kFullDebug)
+	{
+		char tmp[32];
+		strcpy(tmp, packet->systemAddress.ToString());
+		int IDlocation = offset + 7;
+		if (packet->data[IDlocation] == ID_TIMESTAMP && length > 12)
+			IDlocation += 5;
+		Log::debug_log("Relaying for server at %s, to client at %s, ID of relayed message is %s\n", tmp, clientAddress.ToString(), IDtoString(packet->data[IDlocation]));
+	}
+}
 
-	peer->Send(&stream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, targetAddress, false);
+// Relay a message from a server to the client holding a session ID. Like MsgServerRelay, but with a 3 byte header
+void MsgServerSessionRelay(Packet *packet, int offset, int length)
+{
+	// ID(1) + session ID(2)
+	if (length <= 3)
+	{
+		Log::error_log("Malformed session relay message from server at %s\n", packet->systemAddress.ToString());
+		return;
+	}
+	unsigned short sessionId;
+	RakNet::BitStream bitStream(packet->data + offset, length, false);
+	bitStream.IgnoreBits(8); // Ignore the ID_...
+	bitStream.Read(sessionId);
+
+	SystemAddress clientAddress;
+	RakPeerInterface *sender;
+	if (!GetSessionClient(packet->systemAddress, sessionId, &clientAddress, &sender))
+	{
+		Log::debug_log("Dropped relay message from server at %s to unknown session %d\n", packet->systemAddress.ToString(), sessionId);
+		return;
+	}
+	if (!coalescer.Add(sender, clientAddress, packet->data, offset + 3, length - 3, packet->reliability, packet->orderingChannel, RakNet::GetTime()))
+		RelayShard::Forward(peer, sender, 0, 0, packet, offset + 3, length - 3, clientAddress);
 }
 
+// Relay one message from a server to several of its clients. Clients connected to the main peer are sent the packet data
+// itself, clients on a sharded relay port share one copy made for the shard peer
+void MsgServerMulticast(Packet *packet, int offset, int length)
+{
+	// Reused across messages so relaying does not allocate
+	static std::vector<SystemAddress> addresses;
+	static std::vector<SystemAddress> mainTargets;
+	static std::vector<SystemAddress> shardTargets;
+	addresses.clear();
+	mainTargets.clear();
+	shardTargets.clear();
+
+	unsigned char flags;
+	unsigned short count;
+	RakNet::BitStream bitStream(packet->data + offset, length, false);
+	bitStream.IgnoreBits(8); // Ignore the ID_...
+	bitStream.Read(flags);
+	if (!bitStream.Read(count))
+	{
+		Log::error_log("Malformed multicast message from server at %s\n", packet->systemAddress.ToString());
+		return;
+	}
+	for (unsigned short i = 0; i < count; i++)
+	{
+		SystemAddress address;
+		if (flags & PROXY_MULTICAST_SESSIONS)
+		{
+			unsigned short sessionId;
+			RakPeerInterface *sender;
+			if (!bitStream.Read(sessionId))
+			{
+				Log::error_log("Malformed multicast message from server at %s\n", packet->systemAddress.ToString());
+				return;
+			}
+			if (!GetSessionClient(packet->systemAddress, sessionId, &address, &sender))
+				continue;
+		}
+		else if (!bitStream.Read(address))
+		{
+			Log::error_log("Malformed multicast message from server at %s\n", packet->systemAddress.ToString());
+			return;
+		}
+		addresses.push_back(address);
+	}
+	int payloadOffset = offset + BITS_TO_BYTES(bitStream.GetReadOffset());
+	int payloadLength = offset + length - payloadOffset;
+	if (payloadLength <= 0)
+	{
+		Log::error_log("Empty multicast message from server at %s\n", packet->systemAddress.ToString());
+		return;
+	}
+
+	RelayShard *shard = serverShards.Get(packet->systemAddress);
+	RakPeerInterface *shardPeer = shard ? shard->GetPeer() : peer;
+	if (flags & PROXY_MULTICAST_EXCLUDE)
+	{
+		relayState.GetServerClients(packet->systemAddress, mainTargets);
+		if (shard)
+			shard->GetServerUsers(packet->systemAddress, shardPeer == peer ? mainTargets : shardTargets);
+		for (std::vector<SystemAddress>::iterator i = addresses.begin(); i != addresses.end(); i++)
+		{
+			mainTargets.erase(std::remove(mainTargets.begin(), mainTargets.end(), *i), mainTargets.end());
+			shardTargets.erase(std::remove(shardTargets.begin(), shardTargets.end(), *i), shardTargets.end());
+		}
+	}
+	else
+	{
+		for (std::vector<SystemAddress>::iterator i = addresses.begin(); i != addresses.end(); i++)
+		{
+			if (shardPeer != peer && shardPeer->IsConnected(*i))
+				shardTargets.push_back(*i);
+			else
+				mainTargets.push_back(*i);
+		}
+	}
+
+	if (coalescer.IsEnabled())
+	{
+		RakNetTime now = RakNet::GetTime();
+		coalescer.Add(peer, mainTargets, packet->data, payloadOffset, payloadLength, packet->reliability, packet->orderingChannel, now);
+		coalescer.Add(shardPeer, shardTargets, packet->data, payloadOffset, payloadLength, packet->reliability, packet->orderingChannel, now);
+	}
+	RelayShard::Multicast(peer, peer, packet, payloadOffset, payloadLength, mainTargets);
+	RelayShard::Multicast(peer, shardPeer, packet, payloadOffset, payloadLength, shardTargets);
+
+	if (Log::sDebugLevel >= kFullDebug)
+	{
+		int IDlocation = payloadOffset;
+		if (packet->data[IDlocation] == ID_TIMESTAMP && payloadLength > 5)
+			IDlocation += 5;
+		Log::debug_log("Multicasting for server at %s to %d clients, ID of relayed message is %s\n", packet->systemAddress.ToString(), (int)(mainTargets.size() + shardTargets.size()), IDtoString(packet->data[IDlocation]));
+	}
+}
+// Relay every message in a batch from a server. Each is relayed as if it had been sent on its own, with the reliability of the batch
+void MsgServerBatch(Packet *packet)
+{
+	RakNet::BitStream bitStream(packet->data, packet->length, false);
+	bitStream.IgnoreBits(8); // Ignore the ID_...
+	unsigned short length;
+	while (bitStream.GetNumberOfUnreadBits() > 0)
+	{
+		if (!bitStream.Read(length) || length == 0 || BITS_TO_BYTES(bitStream.GetNumberOfUnreadBits()) < length)
+		{
+			Log::error_log("Malformed batch message from server at %s\n", packet->systemAddress.ToString());
+			return;
+		}
+		int offset = BITS_TO_BYTES(bitStream.GetReadOffset());
+		switch (packet->data[offset])
+		{
+			case ID_PROXY_SERVER_MESSAGE:
+				MsgServerRelay(packet, offset, length);
+				break;
+			case ID_PROXY_SERVER_MULTICAST_MESSAGE:
+				MsgServerMulticast(packet, offset, length);
+				break;
+			case ID_PROXY_SERVER_SESSION_MESSAGE:
+				MsgServerSessionRelay(packet, offset, length);
+				break;
+			default:
+				Log::error_log("Unexpected ID %d in batch message from %s\n", packet->data[offset], packet->systemAddress.ToString());
+		}
+		bitStream.IgnoreBits(BYTES_TO_BITS(length));
+	}
+}
 
 char* IDtoString(const int ID)
 {
@@ -215,27 +455,35 @@ char* IDtoString(const int ID)
 void DebugServerRelay()
 {
 	Log::print_log("Connection count is %d\n", peer->NumberOfConnections());
-	Log::print_log("Used ports: ");
-	if (Log::sDebugLevel == kInformational)
-	{
-		for (ServerPorts::iterator i = usedPorts.begin(); i != usedPorts.end(); i++)
-			printf("%d ", *i);
-		printf("\n");
-	}
-	Log::print_log("Server ports: ");
-	if (Log::sDebugLevel == kInformational)
+	for (int i = 0; i < shardCount; i++)
+		shards[i].DebugPrint();
+}
+
+RelayShard* GetPortShard(unsigned short port)
+{
+	for (int i = 0; i < shardCount; i++)
 	{
-		for (ServerPorts::iterator i = serverPorts.begin(); i != serverPorts.end(); i++)
-			printf("%d ", *i);
-		printf("\n");
+		if (shards[i].OwnsPort(port))
+			return &shards[i];
 	}
-	Log::print_log("Server map: ");
-	if (Log::sDebugLevel == kInformational)
+	return 0;
+}
+
+// Least loaded shard with a free port, or 0 if all ports are in use
+RelayShard* GetFreeShard()
+{
+	RelayShard *freeShard = 0;
+	int minLoad = 0;
+	for (int i = 0; i < shardCount; i++)
 	{
-		for (ServerMap::iterator i = serverMap.begin(); i != serverMap.end(); i++)
-			printf("[%d %s] ", i->first, i->second.ToString());
-		printf("\n");
+		int load = shards[i].GetLoad();
+		if (load >= 0 && (freeShard == 0 || load < minLoad))
+		{
+			freeShard = &shards[i];
+			minLoad = load;
+		}
 	}
+	return freeShard;
 }
 
 void DebugClientRelay()
@@ -244,162 +492,77 @@ void DebugClientRelay()
 	Log::print_log("Relay map: ");
 	if (Log::sDebugLevel == kInformational)
 	{
-		for (RelayMap::iterator i = relayMap.begin(); i != relayMap.end(); i++)
-			printf("[%s %s] ", i->first.ToString(), i->second.ToString());
-		printf("\n");
+		relayState.PrintClients();
 	}
 	Log::print_log("Relay queue: ");
 	if (Log::sDebugLevel == kInformational)
 	{
-		for (RelayQueue::iterator i = queue.begin(); i != queue.end(); i++)
-			printf("%s ", ((RelayItem)*i).target.ToString());
-		printf("\n");
+		relayQueue.Print();
 	}
 }
 
-// Check through relay map and disconnect all clients which were connected
-// or attempting connection to this server
+// Disconnect all clients which were connected or attempting connection to this server
 void CleanClient(SystemAddress serverAddress)
 {
-	RelayMap::iterator i = relayMap.begin();
-	while (i != relayMap.end())
+	std::list<SystemAddress> clients;
+	relayState.RemoveServerClients(serverAddress, clients);
+	for (std::list<SystemAddress>::iterator i = clients.begin(); i != clients.end(); i++)
 	{
-		if (i->second == serverAddress)
-		{
-			Log::print_log("Disconnecting client %s\n", i->first.ToString());
-			peer->CloseConnection(i->first, true);
-			relayMap.erase(i++);
-		}
-		else
-			i++;
+		Log::print_log("Disconnecting client %s\n", i->ToString());
+		peer->CloseConnection(*i, true);
 	}
 }
 
-//MRB 8.27.12 -- disconnect any peers that were using this port, called when the port owner disconnects
-void DisconnectPeersUsingPort(int port)
-{
-	PortUsers::iterator next = portUsers.begin();
-	while (next != portUsers.end())
-	{
-		PortUser &item = *next;
-		if (port == item.port)
-		{
-			Log::debug_log("Disconnecting peer %s from port %d\n", item.userAddress.ToString(), port);
-
-			peer->CloseConnection(item.userAddress, true);
-
-			next = portUsers.erase(next);
-		}
-		else
-			next++;
-	}
-
-}
-
 void CleanQueue(SystemAddress removeMe)
 {
 	Log::debug_log("Cleaning %s\n", removeMe.ToString());
 
 	// If this is a server relay
-	for (ServerMap::iterator i=serverMap.begin(); i!=serverMap.end(); i++)
+	RelayShard *shard = serverShards.Remove(removeMe);
+	if (shard)
 	{
-		if (i->second == removeMe)
-		{
-			int freePort = i->first;
-			serverMap.erase(i);
-			ServerPorts::iterator result = find( usedPorts.begin(), usedPorts.end(), freePort );
-			if( result != usedPorts.end() )
-			{
-				Log::debug_log("Freeing server port %d\n", freePort);
-				usedPorts.erase(result);
-				// Add to the back of the list so the port is more likely not to be immediately reused
-				serverPorts.push_back(freePort);
-
-				DisconnectPeersUsingPort(freePort); //MRB 8.27.12 -- disconnect any peers that were using this port
-			}
-			else
-			{
-				Log::error_log("Failed to find server port %d in list\n", freePort);
-			}
-			DebugServerRelay();
-			return;
-		}
+		int freePort = shard->ReleaseServer(removeMe);	//MRB 8.27.12 -- disconnect any peers that were using this port
+		if (freePort != 0)
+			Log::debug_log("Freeing server port %d\n", freePort);
+		else
+			Log::error_log("Failed to find server port of %s\n", removeMe.ToString());
+		DebugServerRelay();
+		return;
 	}
 
 	// Process client relay disconnection
+	unsigned int discarded = relayQueue.Discard(removeMe);
+	if (discarded > 0)
+		Log::debug_log("Removed %d queued messages to target at %s\n", discarded, removeMe.ToString());
 
-	if (!queue.empty())
-	{
-		RelayQueue::iterator next = queue.begin();
-		for (RelayQueue::iterator i = next; i != queue.end(); i=next)
-		{
-			RelayItem &item = *i;
-			next++;
-			if (removeMe == item.target)
-			{
-				Log::debug_log("Removing queued message to target at %s\n", removeMe.ToString());
-				queue.erase(i);
-			}
-		}
-	}
 	// Notify server that the client has disconnected
-	RakNet::BitStream stream;
-	stream.Write((unsigned char)ID_PROXY_MESSAGE);
-	stream.Write(removeMe);
-	stream.Write((unsigned char)ID_DISCONNECTION_NOTIFICATION);
-	if (!peer->Send(&stream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, relayMap[removeMe], false))
-	{
-		Log::error_log("Failed to send clean disconnect notification for client %s\n", removeMe.ToString());
-	}
-
-	// If this is on the receiving end of a client address, then this is a server
-	bool isServer = false;
-	std::queue<SystemAddress> remove;
-	RelayMap::iterator i;
-	for (i=relayMap.begin(); i!=relayMap.end(); i++)
+	SystemAddress targetServer;
+	bool isClient = relayState.GetClientTarget(removeMe, &targetServer);
+	if (isClient)
 	{
-		if (i->second == removeMe)
+		RakNet::BitStream stream;
+		WriteRelayHeader(stream, removeMe, GetClientSession(removeMe, GetServerProtocolVersion(targetServer)));
+		stream.Write((unsigned char)ID_DISCONNECTION_NOTIFICATION);
+		// Relay what the client sent before it disconnected first
+		batcher.Flush(peer);
+		if (!peer->Send(&stream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, targetServer, false))
 		{
-			isServer = true;
-			remove.push(i->first);
+			Log::error_log("Failed to send clean disconnect notification for client %s\n", removeMe.ToString());
 		}
 	}
-	// If this is a server scroll through all addresses in the relay map and disconnect the clients.
-	if (isServer)
+
+	// If this is on the receiving end of a client address, then this is a server, so disconnect its clients.
+	if (relayState.HasClients(removeMe))
 	{
 		Log::debug_log("%s is a server\n", removeMe.ToString());
-		while (!remove.empty())
-		{
-			Log::print_log("Disconnecting client %s\n", remove.front().ToString());
-			relayMap.erase(remove.front());
-			peer->CloseConnection(remove.front(), true);
-			remove.pop();
-		}
+		CleanClient(removeMe);
 	}
 
-	// If the server is in the relay map and there is a connection to him and there is
-	// no one else in the relay map using that server, then its ok to remove and disconnect
-	if (relayMap.count(removeMe))
+	// If there is no one else using the server of this client, then its ok to disconnect from it
+	if (isClient && relayState.RemoveClient(removeMe, &targetServer) && !relayState.HasClients(targetServer))
 	{
-		Log::debug_log("Count is %d\n", relayMap.count(removeMe));
-		// Grab the address of the server
-		i = relayMap.find(removeMe);
-		SystemAddress targetServer = i->second;
-		// Remove instance of server accociated with disconnected client
-		relayMap.erase(removeMe);
-		// Check if anyone else is using the same server
-		bool inUse = false;
-		for (i=relayMap.begin(); i!=relayMap.end(); i++)
-		{
-			if (i->second == targetServer)
-				inUse = true;
-		}
-		// No one else is using the clients server, then its ok to diconnect
-		if (!inUse)
-		{
-			Log::print_log("Diconnecting from unused server %s\n", targetServer.ToString());
-			peer->CloseConnection(targetServer, true);
-		}
+		Log::print_log("Diconnecting from unused server %s\n", targetServer.ToString());
+		peer->CloseConnection(targetServer, true);
 	}
 	DebugClientRelay();
 }
@@ -415,6 +578,9 @@ int main(int argc, char *argv[])
 	int portCount = endPort - startPort + 1;
 	bool useLogFile = false;
 	bool daemonMode = false;
+	int receiveThreadCount = 0;
+	int updateThreadCount = 0;
+	char *password = 0;
 
 	// Default debug level is informational, so you see an overview of whats going on.
 	Log::sDebugLevel = kInformational;
@@ -475,7 +641,8 @@ int main(int argc, char *argv[])
 				}
 				case 'i':
 				{
-					peer->SetIncomingPassword(argv[i+1], strlen(argv[i+1]));
+					password = argv[i+1];
+					peer->SetIncomingPassword(password, strlen(password));
 					i++; //ULY 170608: Fix silly parsing issue.
 					break;
 				}
@@ -502,6 +669,51 @@ int main(int argc, char *argv[])
 					i++;
 					break;
 				}
+				case 't':
+				{
+					receiveThreadCount = atoi(argv[i+1]);
+					i++;
+					if (receiveThreadCount < 0)
+					{
+						fprintf(stderr, "Receive thread count must be 0 or higher.\n");
+						return 1;
+					}
+					break;
+				}
+				case 'u':
+				{
+					updateThreadCount = atoi(argv[i+1]);
+					i++;
+					if (updateThreadCount < 0)
+					{
+						fprintf(stderr, "Update thread count must be 0 or higher.\n");
+						return 1;
+					}
+					break;
+				}
+				case 'k':
+				{
+					int keyLength = atoi(argv[i+1]);
+					i++;
+					if (keyLength < 0)
+					{
+						fprintf(stderr, "State update key length must be 0 or higher.\n");
+						return 1;
+					}
+					coalescer.SetKeyLength(keyLength);
+					break;
+				}
+				case 's':
+				{
+					shardCount = atoi(argv[i+1]);
+					i++;
+					if (shardCount < 0)
+					{
+						fprintf(stderr, "Relay shard count must be 0 or higher.\n");
+						return 1;
+					}
+					break;
+				}
 				case '?':
 					usage();
 					return 0;
@@ -554,15 +766,54 @@ int main(int argc, char *argv[])
 	Log::startup_log("Listen port set to %d\n", listenPort);
 	Log::startup_log("Server relay ports set to %d to %d (%d ports)\n", startPort, endPort, portCount);
 	Log::startup_log("Using facilitator at %s\n", facilitatorAddress.ToString());
-	SocketDescriptor *sds = new SocketDescriptor[portCount+1];	//MRB 9.18.12: +1 to allow for listenPort socket
+	if (receiveThreadCount > 0)
+		Log::startup_log("Receiving on all ports with %d threads\n", receiveThreadCount);
+	if (shardCount > portCount)
+		shardCount = portCount;
+	if (shardCount > 0)
+		Log::startup_log("Relay ports split across %d shards\n", shardCount);
+	if (updateThreadCount > 0)
+		Log::startup_log("Updating connections with %d extra threads per peer\n", updateThreadCount);
+	if (coalescer.IsEnabled())
+		Log::startup_log("Coalescing state updates to congested clients\n");
+
+	// Unsharded, the main peer is bound to the relay ports as well
+	int mainPortCount = shardCount > 0 ? 0 : portCount;
+	SocketDescriptor *sds = new SocketDescriptor[mainPortCount+1];	//MRB 9.18.12: +1 to allow for listenPort socket
 	sds[0] = SocketDescriptor(listenPort, 0);
 	int port = startPort;
-	for (int i=1; i<=portCount; i++)			   	//MRB 9.18.12: 'less than equal' instead of 'less than' so endPort is actually used
+	for (int i=1; i<=mainPortCount; i++)			   	//MRB 9.18.12: 'less than equal' instead of 'less than' so endPort is actually used
 	{
-		sds[i] = SocketDescriptor(port, 0);
-		serverPorts.push_back(port++);
+		sds[i] = SocketDescriptor(port++, 0);
 	}
-	bool r = peer->Startup(connectionCount, 10, sds, portCount+1);	  	//MRB 9.18.12: +1 to allow for listenPort socket
+	peer->SetReceiveThreadCount(receiveThreadCount);
+	peer->SetUpdateThreadCount(updateThreadCount);
+	bool r = peer->Startup(connectionCount, 10, sds, mainPortCount+1);	  	//MRB 9.18.12: +1 to allow for listenPort socket
+
+	if (shardCount > 0)
+	{
+		shards = new RelayShard[shardCount];
+		for (int i = 0; i < shardCount; i++)
+		{
+			int shardStart = startPort + i*portCount/shardCount;
+			int shardEnd = startPort + (i+1)*portCount/shardCount - 1;
+			if (!shards[i].Startup(peer, shardStart, shardEnd, connectionCount, receiveThreadCount, updateThreadCount, password, password ? strlen(password) : 0))
+				r = false;
+		}
+	}
+	else
+	{
+		shardCount = 1;
+		shards = new RelayShard[1];
+		shards[0].Startup(peer, startPort, endPort);
+	}
+
+	// Session IDs 1-65535 are split between the listen port clients and the relay port users of each shard, so a server
+	// can tell which of them holds a session from the ID alone
+	int sessionsPerState = 65535 / (shardCount + 1);
+	relayState.SetSessionRange(1, sessionsPerState);
+	for (int i = 0; i < shardCount; i++)
+		shards[i].SetSessionRange(1 + (i+1)*sessionsPerState, (i+2)*sessionsPerState);
 
 	if (!r)
 	{
@@ -607,58 +858,13 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 					CleanClient(packet->systemAddress);
 					break;
 				}
-				// DEBUG: Sanity check
-				ServerPorts::iterator result = find( usedPorts.begin(), usedPorts.end(), packet->rcvPort );
-				if( result == usedPorts.end())
-				{
-					Log::error_log("Communication received on uninitialized server port %d\n", packet->rcvPort);
-					int IDlocation = 0;
-					if (packet->data[0] == ID_TIMESTAMP)
-						IDlocation = 5;
-					Log::error_log("Rejected message from client at %s, ID of message is %s\n", packet->systemAddress.ToString(), IDtoString(packet->data[IDlocation]));
-					break;
-				}
-
-
-				//MRB 8.27.12 -- keep track of who is using this port, add to our port user list on any new connections and remove from list on disconnects
-				PortUser portUser;
-				portUser.userAddress = packet->systemAddress;
-				portUser.port = packet->rcvPort;
-
-				if (packet->data[0] == ID_NEW_INCOMING_CONNECTION)
+				RelayShard *shard = GetPortShard(packet->rcvPort);
+				if (shard == 0)
 				{
-					portUsers.push_back(portUser);
+					Log::error_log("Communication received on unknown port %d from %s\n", packet->rcvPort, packet->systemAddress.ToString());
 					break;
 				}
-
-				if (packet->data[0] == ID_DISCONNECTION_NOTIFICATION || packet->data[0] == ID_CONNECTION_LOST)
-				{
-					// DEBUG
-					Log::print_log("%s has diconnected\n", packet->systemAddress.ToString());
-					DebugServerRelay();
-
-					//MRB 8.27.12 -- peer is no longer using this port
-					portUsers.remove(portUser);
-				}
-
-				SystemAddress targetAddress;
-				RakNet::BitStream bitStream(packet->data, packet->length, false);
-				bitStream.IgnoreBits(8); // Ignore the ID_...
-
-				// Lookup target address from map
-				if (serverMap.count(packet->rcvPort) != 0)
-					targetAddress = serverMap[packet->rcvPort];
-				else
-					Log::error_log("Error: Relay failed for client at %s, server address not found\n", packet->systemAddress.ToString());
-
-				char tmp[32];
-				strcpy(tmp, packet->systemAddress.ToString());
-				int IDlocation = 0;
-				if (packet->data[0] == ID_TIMESTAMP)
-					IDlocation = 5;
-				Log::debug_log("Relaying for client at %s, to server at %s, ID of relayed message is %s\n", tmp, targetAddress.ToString(), IDtoString(packet->data[IDlocation]));
-
-				MsgClientRelayPassthrough(bitStream, packet, targetAddress);
+				shard->HandlePacket(packet);
 				break;
 			}
 			switch (packet->data[0])
@@ -678,35 +884,21 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 					break;
 				case ID_CONNECTION_REQUEST_ACCEPTED:
 					Log::print_log("Connected to %s\n", packet->systemAddress.ToString());
-					if (!queue.empty())
 					{
-						int totalSize = queue.size();
-						Log::debug_log("Relay queue has %d elements\n", queue.size());
+						RelayItem *items = relayQueue.Take(packet->systemAddress);
 
-						// Check whole queue and send everything with this server as target
-						RelayQueue::iterator next = queue.begin();
-						while (next != queue.end())
+						// Send everything queued with this server as target
+						int sent = 0;
+						for (RelayItem *item = items; item; item = item->next)
 						{
-							RelayItem &item = *next;
-							if (packet->systemAddress == item.target)
-							{
-								RakNet::BitStream bitStream;
-								bitStream.Write(item.packet, item.length);
-								//for (int i=0; i<=item.length; i++)
-								//	printf("%x", item.packet[i]);
-								//printf("\n");
-								peer->Send(&bitStream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, item.target, false);
-
-								Log::debug_log("Sending queued message to target at %s\n", item.target.ToString());
-
-								//delete[] item->packet;
-								next = queue.erase(next);
-							}
-							else
-								next++;
+							peer->Send(item->packet, item->length, HIGH_PRIORITY, item->reliability, item->orderingChannel, item->target, false);
+							Log::debug_log("Sending queued message to target at %s\n", item->target.ToString());
+							sent++;
 						}
+						relayQueue.Release(items);
 
-						Log::debug_log("%d elements sent from queue to target\n", totalSize - queue.size());
+						if (sent > 0)
+							Log::debug_log("%d elements sent from queue to target, %d left in the relay queue\n", sent, relayQueue.GetMessageCount());
 					}
 					break;
 				case ID_CONNECTION_ATTEMPT_FAILED:
@@ -761,7 +953,7 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 					}
 					bitStream.Read(useNat);
 					bitStream.Read(clientVersion);
-					relayMap[packet->systemAddress] = targetAddress;
+					relayState.SetClientTarget(packet->systemAddress, targetAddress);
 
 					char tmp[32];
 					strcpy(tmp, targetAddress.ToString());
@@ -783,18 +975,24 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 
 					Log::print_log("Received server init message from %s, proxy protocol version %d\n", packet->systemAddress.ToString(), proxyVersion);
 
-					unsigned short freePort = 0;
 					RakNet::BitStream responseStream;
-					if (serverPorts.size() > 0)
+					// A server asking again keeps its port, new servers get one from the least loaded shard
+					unsigned short freePort = 0;
+					RelayShard *shard = serverShards.Get(packet->systemAddress);
+					if (shard == 0)
+					{
+						shard = GetFreeShard();
+						if (shard)
+							serverShards.Insert(packet->systemAddress, shard);
+					}
+					if (shard)
+						freePort = shard->AssignPort(packet->systemAddress, proxyVersion);
+					if (freePort != 0)
 					{
-						freePort = serverPorts.front();
-						serverPorts.pop_front();
-						usedPorts.push_front(freePort);
 						responseStream.Write((unsigned char)ID_PROXY_SERVER_INIT);
 						responseStream.Write((int)PROXY_SERVER_PROTOCOL_VERSION);
 						responseStream.Write(freePort);
 						peer->Send(&responseStream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, packet->systemAddress, false);
-						serverMap[freePort] = packet->systemAddress;
 						Log::print_log("Server %s assigned port %d\n", packet->systemAddress.ToString(), freePort);
 					}
 					else
@@ -812,13 +1010,9 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 			case ID_PROXY_CLIENT_MESSAGE:
 				{
 					SystemAddress targetAddress;
-					RakNet::BitStream bitStream(packet->data, packet->length, false);
-					bitStream.IgnoreBits(8); // Ignore the ID_...
 
 					// Lookup target address from map
-					if (relayMap.count(packet->systemAddress) != 0)
-						targetAddress = relayMap[packet->systemAddress];
-					else
+					if (!relayState.GetClientTarget(packet->systemAddress, &targetAddress))
 						Log::error_log("Error: Relay failed for client at %s, target address not found\n", packet->systemAddress.ToString());
 
 					char tmp[32];
@@ -828,40 +1022,30 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 						IDlocation = 6;
 					Log::debug_log("Relaying for client at %s, to server at %s, ID of relayed message is %s\n", tmp, targetAddress.ToString(), IDtoString(packet->data[IDlocation]));
 
-					MsgClientRelay(bitStream, packet, targetAddress);
+					MsgClientRelay(packet, targetAddress);
 				}
 				break;
 			// Relay message from servers
 			case ID_PROXY_SERVER_MESSAGE:
-				{
-					SystemAddress clientAddress;
-					RakNet::BitStream bitStream(packet->data, packet->length, false);
-					bitStream.IgnoreBits(8); // Ignore the ID_...
-
-					// To what client should this message be relayed to
-					bitStream.Read(clientAddress);
-
-					peer->Send(reinterpret_cast<const char*>(packet->data+7), packet->length-7, HIGH_PRIORITY, RELIABLE_ORDERED, 0, clientAddress, false);
-
-					char tmp[32];
-					strcpy(tmp, packet->systemAddress.ToString());
-					int IDlocation = 7;
-					if (packet->data[7] == ID_TIMESTAMP)
-						IDlocation = 12;
-					Log::debug_log("Relaying for server at %s, to client at %s, ID of relayed message is %s\n", tmp, clientAddress.ToString(), IDtoString(packet->data[IDlocation]));
-				}
+				MsgServerRelay(packet, 0, packet->length);
+				break;
+			// Relay message from servers using session IDs
+			case ID_PROXY_SERVER_SESSION_MESSAGE:
+				MsgServerSessionRelay(packet, 0, packet->length);
+				break;
+			// Relay message from servers to several clients
+			case ID_PROXY_SERVER_MULTICAST_MESSAGE:
+				MsgServerMulticast(packet, 0, packet->length);
+				break;
+			// Several relay messages from servers
+			case ID_PROXY_BATCH_MESSAGE:
+				MsgServerBatch(packet);
 				break;
 			case ID_INVALID_PASSWORD:
 				{
-					SystemAddress clientAddress = UNASSIGNED_SYSTEM_ADDRESS;
+					SystemAddress clientAddress;
 					// A server rejected connection, need to find appropriate client address and notify him
-					for (RelayMap::iterator i = relayMap.begin(); i != relayMap.end(); i++) {
-						if ((*i).second == packet->systemAddress) {
-							clientAddress = (*i).first;
-							break;
-						}
-					}
-					if (clientAddress != UNASSIGNED_SYSTEM_ADDRESS) {
+					if (relayState.GetFirstClient(packet->systemAddress, &clientAddress)) {
 						peer->Send(reinterpret_cast<const char*>(packet->data), packet->length, HIGH_PRIORITY, RELIABLE_ORDERED, 0, clientAddress, false);
 						char tmp[32];
 						strcpy(tmp, packet->systemAddress.ToString());
@@ -890,7 +1074,23 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 		}
 		//MRB 8.21.12 -- section end
 
-		RakSleep(30);
+		// Drop messages for servers which are taking too long to connect
+		unsigned int expired = relayQueue.Expire(RakNet::GetTime());
+		if (expired > 0)
+			Log::error_log("Dropped %d queued messages which waited too long for their server, %d left in the relay queue\n", expired, relayQueue.GetMessageCount());
+
+		// Send the state updates held for clients whose backlog has cleared
+		if (coalescer.IsEnabled())
+			coalescer.Update(RakNet::GetTime());
+
+		// Relayed messages are batched until every waiting packet is handled. Unsharded, that includes the relay port packets
+		batcher.Flush(peer);
+		if (shards[0].GetPeer() == peer)
+			shards[0].FlushBatches();
+
+		// Block until the network thread queues a packet instead of sleeping a fixed 30ms, which added up to 30ms of latency on every idle to busy transition.
+		// The timeout is kept so the NAT punchthrough plugin still gets its periodic Update() from ReceiveIgnoreRPC.
+		peer->WaitForPacket(30);
 	}
 
 	if (pidFile)
@@ -898,6 +1098,8 @@ ReceiveAnotherPacket:						//MRB 8.21.12 -- added goto label (see below 'MRB' co
 		if (remove(pidFile) != 0)
 			fprintf(stderr, "Failed to remove PID file at %s\n", pidFile);
 	}
+	// Shards relay to the main peer, so stop them first
+	delete[] shards;
 	peer->Shutdown(100,0);
 	RakNetworkFactory::DestroyRakPeerInterface(peer);
 
@@ -2,7 +2,18 @@
 #include "RakNetTypes.h"
 #include "MessageIdentifiers.h"
 
-#define PROXY_SERVER_PROTOCOL_VERSION 2
+namespace RakNet
+{
+	class BitStream;
+}
+
+#define PROXY_SERVER_PROTOCOL_VERSION 5
+// Servers announcing this version or later in ID_PROXY_SERVER_INIT are sent relayed messages in batches, and may send batches themselves
+#define PROXY_BATCH_PROTOCOL_VERSION 4
+// Servers announcing this version or later refer to relayed peers by 16 bit session ID instead of SystemAddress
+#define PROXY_SESSION_PROTOCOL_VERSION 5
+// Largest ID_PROXY_BATCH_MESSAGE the proxy sends, in bytes. Below the MTU, so a batch is not split
+#define PROXY_MAX_BATCH_SIZE 1200
 #define PROXY_SERVER_VERSION "2.0.0b2"
 
 enum {
@@ -15,27 +26,34 @@ enum {
 	ID_PROXY_CLIENT_MESSAGE,
 	ID_PROXY_SERVER_MESSAGE,
 	ID_PROXY_MESSAGE,
-	ID_PROXY_SERVER_INIT
+	ID_PROXY_SERVER_INIT,
+	// Protocol version 3. Relays one message to several clients of the sending server:
+	// ID(1) + flags(1) + address count(2) + SystemAddress(6) per address + message
+	ID_PROXY_SERVER_MULTICAST_MESSAGE,
+	// Protocol version 4. Several messages relayed with the same reliability and ordering channel:
+	// ID(1) + (length(2) + message) per message. The messages are those the proxy and server would otherwise send on their own
+	ID_PROXY_BATCH_MESSAGE,
+	// Protocol version 5. A peer relaying to the server was given a session ID: ID(1) + session ID(2) + SystemAddress(6).
+	// The proxy sends it before relaying anything from the peer. The session ends with a relayed ID_DISCONNECTION_NOTIFICATION
+	ID_PROXY_SESSION_INIT,
+	// Protocol version 5. Relayed message from a peer to the server: ID(1) + session ID(2) + message. Replaces ID_PROXY_MESSAGE
+	ID_PROXY_SESSION_MESSAGE,
+	// Protocol version 5. Relay message from the server to a peer: ID(1) + session ID(2) + message. Replaces ID_PROXY_SERVER_MESSAGE
+	ID_PROXY_SERVER_SESSION_MESSAGE
 };
 
-
-struct RelayItem
-{
-	char* packet;
-	int length;
-	SystemAddress target;
+// Flags of ID_PROXY_SERVER_MULTICAST_MESSAGE
+enum {
+	// Relay to every client of the server except the listed addresses, instead of to the listed addresses
+	PROXY_MULTICAST_EXCLUDE = 1,
+	// Protocol version 5. Clients are listed by session ID(2) instead of SystemAddress(6)
+	PROXY_MULTICAST_SESSIONS = 2
 };
 
-//MRB 8.27.12 -- Struct to keep track of peers connected on given port, so we can disconnect them if the port owner disconnects.
-struct PortUser
-{
-	SystemAddress userAddress;
-	int port;
-
-	bool operator==( const PortUser& right ) const
-	{
-		return right.userAddress == userAddress
-			&& right.port == port;
-	}
-};
+// Name of a message ID for the debug output. Uses a static buffer
+char* IDtoString(const int ID);
+
+// Writes the header of a message relayed to a server from sender. ID_PROXY_SESSION_MESSAGE if sessionId is not 0, ID_PROXY_MESSAGE otherwise
+void WriteRelayHeader(RakNet::BitStream &header, const SystemAddress &sender, unsigned short sessionId);
+
 
@@ -95,9 +95,15 @@ struct InternalPacket : public InternalPacketFixedSizeTransmissionHeader
 		NORMAL,
 
 		/// data points to a larger block of data, where the larger block is reference counted. internalPacketRefCountedData is used in this case
-		REF_COUNTED
+		REF_COUNTED,
+
+		/// data points into a received Packet shared by RakPeer::SendWithHeader. refCountedData is allocated with rakMalloc by RakPeer rather than from refCountedDataPool
+		REF_COUNTED_PACKET
 	} allocationScheme;
 	InternalPacketRefCountedData *refCountedData;
+	/// Bytes sent in front of data. dataBitLength includes them. Only used for messages that are not split
+	unsigned char headerData[RAKNET_MAX_SEND_HEADER_SIZE];
+	unsigned char headerDataLength;
 	/// How many attempts we made at sending this message
 	unsigned char timesSent;
 	/// The priority level of this packet
@@ -99,6 +99,41 @@
 #define RESEND_BUFFER_ARRAY_MASK 0x1FF
 #endif
 
+/// Reads and writes several datagrams per system call with recvmmsg and sendmmsg. Linux only.
+#ifndef RAKNET_SUPPORT_MMSG
+#if defined(__linux__) && !defined(ANDROID)
+#define RAKNET_SUPPORT_MMSG 1
+#endif
+#endif
+
+/// Supports receiving on all sockets from a small pool of threads using epoll and recvmmsg, instead of one blocking thread per socket.
+/// Only used if RakPeer::SetReceiveThreadCount() is called with a non-zero value before Startup(). Linux only.
+#ifndef RAKNET_SUPPORT_EPOLL
+#if defined(RAKNET_SUPPORT_MMSG)
+#define RAKNET_SUPPORT_EPOLL 1
+#endif
+#endif
+
+/// Maximum number of datagrams read from a socket with one recvmmsg call
+#ifndef RAKNET_RECV_BATCH_SIZE
+#define RAKNET_RECV_BATCH_SIZE 16
+#endif
+
+/// Number of outgoing datagrams the network thread queues before writing them with sendmmsg. Costs MAXIMUM_MTU_SIZE bytes each per RakPeer
+#ifndef RAKNET_SEND_BATCH_SIZE
+#define RAKNET_SEND_BATCH_SIZE 64
+#endif
+
+/// Number of remoteSystemList entries a thread takes at once when RakPeer::SetUpdateThreadCount() is used
+#ifndef RAKNET_UPDATE_BATCH_SIZE
+#define RAKNET_UPDATE_BATCH_SIZE 32
+#endif
+
+/// Largest header RakPeer::SendWithHeader can put in front of a shared payload. Longer headers are copied together with the payload. Costs one byte per message in the send queues
+#ifndef RAKNET_MAX_SEND_HEADER_SIZE
+#define RAKNET_MAX_SEND_HEADER_SIZE 16
+#endif
+
 /// Uncomment if you want to link in the DLMalloc library to use with RakMemoryOverride
 // #define _LINK_DL_MALLOC
 
@@ -13,6 +13,7 @@
 #include "NativeTypes.h"
 #include "RakNetTime.h"
 #include "Export.h"
+#include "PacketPriority.h"
 
 /// Forward declaration
 namespace RakNet
@@ -111,6 +112,7 @@ struct RAK_DLL_EXPORT SystemAddress
 #define SystemAddress_Size 6
 
 class RakPeerInterface;
+struct InternalPacketRefCountedData;
 
 /// All RPC functions have the same parameter list - this structure.
 /// \deprecated use RakNet::RPC3 instead
@@ -305,12 +307,22 @@ struct Packet
 	/// The local receive port to which the packet was sent
 	unsigned short rcvPort;
 
+	/// The reliability the sender used. RELIABLE_ORDERED for packets generated locally
+	PacketReliability reliability;
+
+	/// The ordering channel the sender used. 0 for packets generated locally, or if \a reliability does not use ordering channels
+	unsigned char orderingChannel;
+
 	/// The data from the sender
 	unsigned char* data;
 
 	/// @internal
 	/// Indicates whether to delete the data, or to simply delete the packet.
 	bool deleteData;
+
+	/// @internal
+	/// Set once \a data is shared with sends made by RakPeer::SendWithHeader. \a data is then freed by the network thread when the last reference is gone
+	InternalPacketRefCountedData *refCountedData;
 };
 
 ///  Index of an unassigned player
@@ -17,6 +17,11 @@
 #include <unistd.h>
 #endif
 
+#if defined(RAKNET_SUPPORT_EPOLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #if defined(new)
 #pragma push_macro("new")
 #undef new
@@ -51,9 +56,23 @@
 RAK_THREAD_DECLARATION(UpdateNetworkLoop);
 RAK_THREAD_DECLARATION(RecvFromLoop);
 RAK_THREAD_DECLARATION(UDTConnect);
+RAK_THREAD_DECLARATION(UpdateWorkerLoop);
+#if defined(RAKNET_SUPPORT_EPOLL)
+RAK_THREAD_DECLARATION(EpollRecvFromLoop);
+#endif
 
 #define REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE 8
 
+// Full memory barrier around the remoteSystemLookup sequence lock
+static inline void RemoteSystemLookupBarrier(void)
+{
+#if defined(_WIN32) && !defined(_XBOX) && !defined(X360)
+	MemoryBarrier();
+#elif defined(__GNUC__)
+	__sync_synchronize();
+#endif
+}
+
 enum {
 	ID_PROXY_SERVER_MESSAGE = 134
 };
@@ -200,6 +219,9 @@ Packet *RakPeer::AllocPacket(unsigned dataSize, const char *file, unsigned int l
 	p->deleteData=true;
 	p->guid=UNASSIGNED_RAKNET_GUID;
 	p->rcvPort=0;
+	p->reliability=RELIABLE_ORDERED;
+	p->orderingChannel=0;
+	p->refCountedData=0;
 	return p;
 }
 
@@ -217,6 +239,9 @@ Packet *RakPeer::AllocPacket(unsigned dataSize, unsigned char *data, const char
 	p->deleteData=true;
 	p->guid=UNASSIGNED_RAKNET_GUID;
 	p->rcvPort=0;
+	p->reliability=RELIABLE_ORDERED;
+	p->orderingChannel=0;
+	p->refCountedData=0;
 	return p;
 }
 
@@ -240,11 +265,29 @@ RakPeer::RakPeer()
 	maximumNumberOfPeers = 0;
 	//remoteSystemListSize=0;
 	remoteSystemList = 0;
+	activeSystemList = 0;
+	activeSystemListSize = 0;
 	remoteSystemLookup=0;
+	remoteSystemLookupEntries=0;
+	remoteSystemLookupSequence=0;
 	bytesSentPerSecond = bytesReceivedPerSecond = 0;
 	endThreads = true;
 	isMainLoopThreadActive = false;
 	isRecvFromLoopThreadActive = false;
+	receiveThreadCount = 0;
+	recvFromThreadsActive = 0;
+	updateThreadCount = 0;
+	updateWorkers = 0;
+	endUpdateThreads = true;
+	updateThreadsActive = 0;
+	updateCycle = 0;
+	updateCursor = 0;
+	updateWorkersBusy = 0;
+	updateTimeNS = 0;
+#if defined(RAKNET_SUPPORT_EPOLL)
+	receiveEpoll = -1;
+	receiveWakeEvent = -1;
+#endif
 	// isRecvfromThreadActive=false;
 	occasionalPing = false;
 	allowInternalRouting=false;
@@ -289,11 +332,11 @@ RakPeer::RakPeer()
 	packetAllocationPool.SetPageSize(sizeof(DataStructures::MemoryPool<Packet>::MemoryWithPage)*32);
 	packetAllocationPoolMutex.Unlock();
 
-	remoteSystemIndexPool.SetPageSize(sizeof(DataStructures::MemoryPool<RemoteSystemIndex>::MemoryWithPage)*32);
-
 	GenerateGUID();
 
 	quitAndDataEvents.InitEvent();
+	packetReturnEvent.InitEvent();
+	updateDoneEvent.InitEvent();
 	limitConnectionFrequencyFromTheSameIP=false;
 	ResetSendReceipt();
 }
@@ -315,6 +358,8 @@ RakPeer::~RakPeer()
 	RakNet::StringTable::RemoveReference();
 
 	quitAndDataEvents.CloseEvent();
+	packetReturnEvent.CloseEvent();
+	updateDoneEvent.CloseEvent();
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -504,6 +549,10 @@ bool RakPeer::Startup( unsigned short maxConnections, int _threadSleepTimer, Soc
 		remoteSystemList = RakNet::OP_NEW_ARRAY<RemoteSystemStruct>(maximumNumberOfPeers, __FILE__, __LINE__ );
 
 		remoteSystemLookup = RakNet::OP_NEW_ARRAY<RemoteSystemIndex*>((unsigned int) maximumNumberOfPeers * REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE, __FILE__, __LINE__ );
+		remoteSystemLookupEntries = RakNet::OP_NEW_ARRAY<RemoteSystemIndex>(maximumNumberOfPeers, __FILE__, __LINE__ );
+
+		activeSystemList = RakNet::OP_NEW_ARRAY<unsigned int>(maximumNumberOfPeers, __FILE__, __LINE__ );
+		activeSystemListSize = 0;
 
 		for ( i = 0; i < maximumNumberOfPeers; i++ )
 		//for ( i = 0; i < remoteSystemListSize; i++ )
@@ -515,6 +564,9 @@ bool RakPeer::Startup( unsigned short maxConnections, int _threadSleepTimer, Soc
 			remoteSystemList[ i ].myExternalSystemAddress = UNASSIGNED_SYSTEM_ADDRESS;
 			remoteSystemList[ i ].connectMode=RemoteSystemStruct::NO_ACTION;
 			remoteSystemList[ i ].MTUSize = defaultMTUSize;
+			remoteSystemList[ i ].reliabilityLayer.SetSendToQueue(&sendToQueue);
+			remoteSystemLookupEntries[ i ].index = i;
+			remoteSystemLookupEntries[ i ].next = 0;
 			#ifdef _DEBUG
 			remoteSystemList[ i ].reliabilityLayer.ApplyNetworkSimulator(_packetloss, _minExtraPing, _extraPingVariance);
 			#endif
@@ -570,8 +622,32 @@ bool RakPeer::Startup( unsigned short maxConnections, int _threadSleepTimer, Soc
 
 		if ( isMainLoopThreadActive == false )
 		{
+			int errorCode;
 
-			int errorCode = RakNet::RakThread::Create(UpdateNetworkLoop, this, threadPriority);
+			if (updateThreadCount>0)
+			{
+				endUpdateThreads=false;
+				updateWorkers=RakNet::OP_NEW_ARRAY<UpdateWorker>(updateThreadCount, __FILE__, __LINE__ );
+				for (i=0; i<updateThreadCount; i++)
+				{
+					updateWorkers[i].rakPeer=this;
+					updateWorkers[i].rnr.SeedMT( GenerateSeedFromGuid()+i+1 );
+					updateWorkers[i].startEvent.InitEvent();
+					updateWorkers[i].cycle=updateCycle;
+				}
+				for (i=0; i<updateThreadCount; i++)
+				{
+					errorCode = RakNet::RakThread::Create(UpdateWorkerLoop, &updateWorkers[i], threadPriority);
+
+					if ( errorCode != 0 )
+					{
+						Shutdown( 0, 0 );
+						return false;
+					}
+				}
+			}
+
+			errorCode = RakNet::RakThread::Create(UpdateNetworkLoop, this, threadPriority);
 
 			if ( errorCode != 0 )
 			{
@@ -579,6 +655,50 @@ bool RakPeer::Startup( unsigned short maxConnections, int _threadSleepTimer, Soc
 				return false;
 			}
 
+#if defined(RAKNET_SUPPORT_EPOLL)
+			if (receiveThreadCount>0)
+			{
+				receiveEpoll=epoll_create(socketDescriptorCount+1);
+				receiveWakeEvent=eventfd(0,0);
+				if (receiveEpoll==-1 || receiveWakeEvent==-1)
+				{
+					Shutdown( 0, 0 );
+					return false;
+				}
+
+				// Level triggered, so once Shutdown writes to it every receive thread is released
+				struct epoll_event ev;
+				memset(&ev,0,sizeof(ev));
+				ev.events=EPOLLIN;
+				ev.data.fd=receiveWakeEvent;
+				epoll_ctl(receiveEpoll, EPOLL_CTL_ADD, receiveWakeEvent, &ev);
+
+				for (i=0; i<socketDescriptorCount; i++)
+				{
+					if (AddSocketToReceiveEpoll(socketList[i]->s)==false)
+					{
+						Shutdown( 0, 0 );
+						return false;
+					}
+				}
+
+				for (i=0; i<receiveThreadCount; i++)
+				{
+					isRecvFromLoopThreadActive=false;
+					errorCode = RakNet::RakThread::Create(EpollRecvFromLoop, this, threadPriority);
+
+					if ( errorCode != 0 )
+					{
+						Shutdown( 0, 0 );
+						return false;
+					}
+
+					while (  isRecvFromLoopThreadActive == false )
+						RakSleep(10);
+				}
+			}
+			else
+#endif
 			for (i=0; i<socketDescriptorCount; i++)
 			{
 				rpai[i].remotePortRakNetWasStartedOn_PS3=socketDescriptors[i].remotePortRakNetWasStartedOn_PS3;
@@ -795,11 +915,7 @@ unsigned short RakPeer::GetMaximumIncomingConnections( void ) const
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 unsigned short RakPeer::NumberOfConnections(void) const
 {
-	unsigned short i, count=0;
-	for (i=0; i < maximumNumberOfPeers; i++)
-		if (remoteSystemList[i].isActive)
-			count++;
-	return count;
+	return (unsigned short) activeSystemListSize;
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -981,8 +1097,18 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 	}
 
 	quitAndDataEvents.SetEvent();
+	// Release any thread blocked in WaitForPacket
+	packetReturnEvent.SetEvent();
 
 	endThreads = true;
+#if defined(RAKNET_SUPPORT_EPOLL)
+	// Get epoll_wait to unblock
+	if (receiveWakeEvent!=-1)
+	{
+		uint64_t wake=1;
+		write(receiveWakeEvent, &wake, sizeof(wake));
+	}
+#endif
 	// Get recvfrom to unblock
 	for (i=0; i < socketList.Size(); i++)
 	{
@@ -995,6 +1121,27 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 		RakSleep(15);
 	}
 
+	// The network thread is gone, so no cycle can be waiting on the update workers
+	if (updateWorkers)
+	{
+		endUpdateThreads = true;
+		for (i=0; i < updateThreadCount; i++)
+			updateWorkers[i].startEvent.SetEvent();
+		for (;;)
+		{
+			updateMutex.Lock();
+			unsigned int threadsActive=updateThreadsActive;
+			updateMutex.Unlock();
+			if (threadsActive==0)
+				break;
+			RakSleep(15);
+		}
+		for (i=0; i < updateThreadCount; i++)
+			updateWorkers[i].startEvent.CloseEvent();
+		RakNet::OP_DELETE_ARRAY(updateWorkers, __FILE__, __LINE__);
+		updateWorkers=0;
+	}
+
 //	char c=0;
 //	unsigned int socketIndex;
 	// remoteSystemList in Single thread
@@ -1008,6 +1155,7 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 
 		remoteSystemList[ i ].rakNetSocket.SetNull();
 	}
+	activeSystemListSize = 0;
 
 
 	// Setting maximumNumberOfPeers to 0 allows remoteSystemList to be reallocated in Initialize.
@@ -1048,6 +1196,19 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 		}
 	}
 
+#if defined(RAKNET_SUPPORT_EPOLL)
+	if (receiveEpoll!=-1)
+	{
+		close(receiveEpoll);
+		receiveEpoll=-1;
+	}
+	if (receiveWakeEvent!=-1)
+	{
+		close(receiveWakeEvent);
+		receiveWakeEvent=-1;
+	}
+#endif
+
 	DerefAllSockets();
 
 	ClearBufferedCommands();
@@ -1062,6 +1223,8 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 	RemoteSystemStruct * temp = remoteSystemList;
 	remoteSystemList = 0;
 	RakNet::OP_DELETE_ARRAY(temp, __FILE__, __LINE__);
+	RakNet::OP_DELETE_ARRAY(activeSystemList, __FILE__, __LINE__);
+	activeSystemList = 0;
 
 	ClearRemoteSystemLookup();
 
@@ -1092,7 +1255,7 @@ inline bool RakPeer::IsActive( void ) const
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 bool RakPeer::GetConnectionList( SystemAddress *remoteSystems, unsigned short *numberOfSystems ) const
 {
-	int count, index;
+	unsigned int count, index, activeIndex, activeCount;
 	count=0;
 
 	if ( remoteSystemList == 0 || endThreads == true )
@@ -1106,7 +1269,10 @@ bool RakPeer::GetConnectionList( SystemAddress *remoteSystems, unsigned short *n
 	{
 		// remoteSystemList in user thread
 		//for ( count = 0, index = 0; index < remoteSystemListSize; ++index )
-		for ( count = 0, index = 0; index < maximumNumberOfPeers; ++index )
+		activeCount = activeSystemListSize;
+		for ( count = 0, activeIndex = 0; activeIndex < activeCount; ++activeIndex )
+		{
+			index = activeSystemList[ activeIndex ];
 			if ( remoteSystemList[ index ].isActive && remoteSystemList[ index ].connectMode==RemoteSystemStruct::CONNECTED)
 			{
 				if ( count < *numberOfSystems )
@@ -1114,14 +1280,19 @@ bool RakPeer::GetConnectionList( SystemAddress *remoteSystems, unsigned short *n
 
 				++count;
 			}
+		}
 	}
 	else
 	{
 		// remoteSystemList in user thread
 		//for ( count = 0, index = 0; index < remoteSystemListSize; ++index )
-		for ( count = 0, index = 0; index < maximumNumberOfPeers; ++index )
+		activeCount = activeSystemListSize;
+		for ( count = 0, activeIndex = 0; activeIndex < activeCount; ++activeIndex )
+		{
+			index = activeSystemList[ activeIndex ];
 			if ( remoteSystemList[ index ].isActive && remoteSystemList[ index ].connectMode==RemoteSystemStruct::CONNECTED)
 				++count;
+		}
 	}
 
 	*numberOfSystems = ( unsigned short ) count;
@@ -1337,6 +1508,88 @@ uint32_t RakPeer::SendList( const char **data, const int *lengths, const int num
 
 	return usedSendReceipt;
 }
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Sends the data of a received message behind a new header. The payload is referenced from the packet rather than copied,
+// and the packet data is freed by the network thread once DeallocatePacket was called and no message references it anymore
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+uint32_t RakPeer::SendWithHeader( const char *header, const int headerLength, Packet *packet, const int payloadOffset, const int payloadLength, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceipt )
+{
+	RakAssert( !( reliability >= NUMBER_OF_RELIABILITIES || reliability < 0 ) );
+	RakAssert( !( priority > NUMBER_OF_PRIORITIES || priority < 0 ) );
+	RakAssert( !( orderingChannel >= NUMBER_OF_ORDERED_STREAMS ) );
+
+	if ( packet == 0 || headerLength < 0 || (header == 0 && headerLength > 0) || payloadOffset < 0 || payloadLength < 0 || (unsigned int) payloadOffset + payloadLength > packet->length )
+		return 0;
+
+	if ( remoteSystemList == 0 || endThreads == true )
+		return 0;
+
+	if ( broadcast == false && systemIdentifier.IsUndefined() )
+		return 0;
+
+	// Cases the network thread cannot send from the shared payload. Copy as Send() would
+	if ( broadcast || headerLength > RAKNET_MAX_SEND_HEADER_SIZE || payloadLength == 0 || packet->deleteData == false || outputTree || trackFrequencyTable ||
+		IsLoopbackAddress(systemIdentifier,true) || (router && IsConnected(systemIdentifier.systemAddress)==false) )
+	{
+		RakNet::BitStream bitStream;
+		bitStream.WriteAlignedBytes((const unsigned char*) header, headerLength);
+		bitStream.WriteAlignedBytes(packet->data+payloadOffset, payloadLength);
+		return Send(&bitStream, priority, reliability, orderingChannel, systemIdentifier, broadcast, forceReceipt);
+	}
+
+	uint32_t usedSendReceipt;
+	if (forceReceipt!=0)
+		usedSendReceipt=forceReceipt;
+	else
+		usedSendReceipt=IncrementNextSendReceipt();
+
+	// The packet holds one reference, dropped by DeallocatePacket. Only the network thread changes the count after this
+	if (packet->refCountedData==0)
+	{
+		packet->refCountedData = (InternalPacketRefCountedData*) rakMalloc_Ex(sizeof(InternalPacketRefCountedData), __FILE__, __LINE__);
+		if (packet->refCountedData==0)
+		{
+			notifyOutOfMemory(__FILE__, __LINE__);
+			return 0;
+		}
+		packet->refCountedData->sharedDataBlock=packet->data;
+		packet->refCountedData->refCount=1;
+	}
+
+	BufferedCommandStruct *bcs;
+#ifdef _RAKNET_THREADSAFE
+	bcs=bufferedCommands.Allocate( __FILE__, __LINE__ );
+#else
+	bcs=bufferedCommands.WriteLock();
+#endif
+	bcs->data=0;
+	bcs->refCountedData=packet->refCountedData;
+	bcs->payload=(char*) packet->data+payloadOffset;
+	bcs->numberOfBitsToSend=BYTES_TO_BITS(payloadLength);
+	memcpy(bcs->header, header, headerLength);
+	bcs->headerLength=(unsigned char) headerLength;
+	bcs->priority=priority;
+	bcs->reliability=reliability;
+	bcs->orderingChannel=orderingChannel;
+	bcs->systemIdentifier=systemIdentifier;
+	bcs->broadcast=false;
+	bcs->connectionMode=RemoteSystemStruct::NO_ACTION;
+	bcs->receipt=usedSendReceipt;
+	bcs->command=BufferedCommandStruct::BCS_SEND_WITH_HEADER;
+#ifdef _RAKNET_THREADSAFE
+	bufferedCommands.Push(bcs);
+#else
+	bufferedCommands.WriteUnlock();
+#endif
+
+	if (priority==IMMEDIATE_PRIORITY)
+	{
+		// Forces pending sends to go out now, rather than waiting to the next update interval
+		quitAndDataEvents.SetEvent();
+	}
+
+	return usedSendReceipt;
+}
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 // Description:
@@ -1479,6 +1732,32 @@ Packet* RakPeer::ReceiveIgnoreRPC( void )
 	return packet;
 }
 
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Description:
+// Blocks until a packet is waiting in packetReturnQueue, or until timeoutMs elapses
+// The event is signaled by AddPacketToProducer and PushBackPacket, so the caller wakes as soon as a packet is queued
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool RakPeer::WaitForPacket( unsigned int timeoutMs )
+{
+	if ( !( IsActive() ) )
+		return false;
+
+	bool hasPacket;
+	packetReturnMutex.Lock();
+	hasPacket=packetReturnQueue.IsEmpty()==false;
+	packetReturnMutex.Unlock();
+	if (hasPacket)
+		return true;
+
+	// If a packet was pushed after the check above the event is already set, and this returns immediately
+	packetReturnEvent.WaitOnEvent(timeoutMs);
+
+	packetReturnMutex.Lock();
+	hasPacket=packetReturnQueue.IsEmpty()==false;
+	packetReturnMutex.Unlock();
+	return hasPacket;
+}
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 // Description:
 // Call this to deallocate a packet returned by Receive
@@ -1490,7 +1769,31 @@ void RakPeer::DeallocatePacket( Packet *packet )
 
 	if (packet->deleteData)
 	{
-		rakFree_Ex(packet->data, __FILE__, __LINE__ );
+		if (packet->refCountedData)
+		{
+			// Sends made with SendWithHeader may still reference the data. Drop our reference after them, in the network thread
+			if (isMainLoopThreadActive)
+			{
+				BufferedCommandStruct *bcs;
+#ifdef _RAKNET_THREADSAFE
+				bcs=bufferedCommands.Allocate( __FILE__, __LINE__ );
+#else
+				bcs=bufferedCommands.WriteLock();
+#endif
+				bcs->data=0;
+				bcs->refCountedData=packet->refCountedData;
+				bcs->command=BufferedCommandStruct::BCS_RELEASE_PACKET_DATA;
+#ifdef _RAKNET_THREADSAFE
+				bufferedCommands.Push(bcs);
+#else
+				bufferedCommands.WriteUnlock();
+#endif
+			}
+			else
+				ReliabilityLayer::ReleasePacketData(packet->refCountedData, __FILE__, __LINE__ );
+		}
+		else
+			rakFree_Ex(packet->data, __FILE__, __LINE__ );
 		packet->~Packet();
 		packetAllocationPoolMutex.Lock();
 		packetAllocationPool.Release(packet,__FILE__,__LINE__);
@@ -1695,8 +1998,10 @@ bool RakPeer::RPC( const char* uniqueID, const char *data, BitSize_t bitLength,
 		sendList = (unsigned int*) rakMalloc_Ex(sizeof(unsigned)*maximumNumberOfPeers, __FILE__, __LINE__);
 #endif
 
-		for ( remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; remoteSystemIndex++ )
+		unsigned int activeIndex, activeCount = activeSystemListSize;
+		for ( activeIndex = 0; activeIndex < activeCount; activeIndex++ )
 		{
+			remoteSystemIndex = activeSystemList[ activeIndex ];
 			if ( remoteSystemList[ remoteSystemIndex ].isActive && remoteSystemList[ remoteSystemIndex ].systemAddress != systemIdentifier.systemAddress )
 				sendList[sendListSize++]=remoteSystemIndex;
 		}
@@ -2153,9 +2458,10 @@ void RakPeer::GetSystemList(DataStructures::List<SystemAddress> &addresses, Data
 {
 	addresses.Clear(false, __FILE__, __LINE__);
 	guids.Clear(false, __FILE__, __LINE__);
-	int index;
-	for (index=0; index < maximumNumberOfPeers; index++)
+	unsigned int index, activeIndex, activeCount = activeSystemListSize;
+	for (activeIndex=0; activeIndex < activeCount; activeIndex++)
 	{
+		index = activeSystemList[activeIndex];
 		 // Don't give the user players that aren't fully connected, since sends will fail
 		if (remoteSystemList[index].isActive && remoteSystemList[ index ].connectMode==RakPeer::RemoteSystemStruct::CONNECTED)
 		{
@@ -2955,6 +3261,33 @@ void RakPeer::SetUnreliableTimeout(RakNetTime timeoutMS)
 		remoteSystemList[ i ].reliabilityLayer.SetUnreliableTimeout(unreliableTimeout);
 }
 
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Sets how many threads receive from the sockets passed to Startup().
+// 0 uses one RecvFromLoop thread per socket. Otherwise that many EpollRecvFromLoop threads share all sockets
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::SetReceiveThreadCount( unsigned int count )
+{
+	RakAssert(IsActive()==false);
+	if (IsActive())
+		return;
+#if defined(RAKNET_SUPPORT_EPOLL)
+	receiveThreadCount=count;
+#else
+	(void) count;
+#endif
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Sets how many UpdateWorkerLoop threads help the network thread call ReliabilityLayer::Update for the remote systems
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::SetUpdateThreadCount( unsigned int count )
+{
+	RakAssert(IsActive()==false);
+	if (IsActive())
+		return;
+	updateThreadCount=count;
+}
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 // Send a message to host, with the IP socket option TTL set to 3
 // This message will not reach the host, but will open the router.
@@ -3175,6 +3508,7 @@ void RakPeer::PushBackPacket( Packet *packet, bool pushAtHead)
 	else
 		packetReturnQueue.Push(packet,__FILE__,__LINE__);
 	packetReturnMutex.Unlock();
+	packetReturnEvent.SetEvent();
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -3544,8 +3878,10 @@ RakNetStatistics * const RakPeer::GetStatistics( const SystemAddress systemAddre
 	{
 		bool firstWrite=false;
 		// Return a crude sum
-		for ( unsigned short i = 0; i < maximumNumberOfPeers; i++ )
+		unsigned int activeCount = activeSystemListSize;
+		for ( unsigned int activeIndex = 0; activeIndex < activeCount; activeIndex++ )
 		{
+			unsigned int i = activeSystemList[ activeIndex ];
 			if (remoteSystemList[ i ].isActive)
 			{
 				RakNetStatistics rnsTemp;
@@ -3598,32 +3934,17 @@ unsigned int RakPeer::GetReceiveBufferSize(void)
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 int RakPeer::GetIndexFromSystemAddress( const SystemAddress systemAddress, bool calledFromNetworkThread ) const
 {
-	unsigned i;
-
 	if ( systemAddress == UNASSIGNED_SYSTEM_ADDRESS )
 		return -1;
 
 	if (systemAddress.systemIndex!=(SystemIndex)-1 && systemAddress.systemIndex < maximumNumberOfPeers && remoteSystemList[systemAddress.systemIndex].systemAddress==systemAddress && remoteSystemList[ systemAddress.systemIndex ].isActive)
 		return systemAddress.systemIndex;
 	
+	// The lookup holds the slot last assigned to this address, which is the active one if there is one
 	if (calledFromNetworkThread)
-	{
 		return GetRemoteSystemIndex(systemAddress);
-	}
 	else
-	{
-		// remoteSystemList in user and network thread
-		for ( i = 0; i < maximumNumberOfPeers; i++ )
-			if ( remoteSystemList[ i ].isActive && remoteSystemList[ i ].systemAddress == systemAddress )
-				return i;
-
-		// If no active results found, try previously active results.
-		for ( i = 0; i < maximumNumberOfPeers; i++ )
-			if ( remoteSystemList[ i ].systemAddress == systemAddress )
-				return i;
-	}
-
-	return -1;
+		return GetRemoteSystemIndexFromUserThread(systemAddress);
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 int RakPeer::GetIndexFromGuid( const RakNetGUID guid )
@@ -3754,41 +4075,22 @@ RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystem( const AddressOrGUID syste
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystemFromSystemAddress( const SystemAddress systemAddress, bool calledFromNetworkThread, bool onlyActive ) const
 {
-	unsigned i;
-
 	if ( systemAddress == UNASSIGNED_SYSTEM_ADDRESS )
 		return 0;
 
+	unsigned int index;
 	if (calledFromNetworkThread)
-	{
-		unsigned int index = GetRemoteSystemIndex(systemAddress);
-		if (index!=(unsigned int) -1)
-		{
-			if (onlyActive==false || remoteSystemList[ index ].isActive==true )
-			{
-				RakAssert(remoteSystemList[index].systemAddress==systemAddress);
-				return remoteSystemList + index;
-			}
-		}
-	}
+		index = GetRemoteSystemIndex(systemAddress);
 	else
-	{
-		int deadConnectionIndex=-1;
+		index = GetRemoteSystemIndexFromUserThread(systemAddress);
 
-		// Active connections take priority.  But if there are no active connections, return the first systemAddress match found
-		for ( i = 0; i < maximumNumberOfPeers; i++ )
+	if (index!=(unsigned int) -1)
+	{
+		if (onlyActive==false || remoteSystemList[ index ].isActive==true )
 		{
-			if (remoteSystemList[ i ].systemAddress == systemAddress)
-			{
-				if ( remoteSystemList[ i ].isActive )
-					return remoteSystemList + i;
-				else if (deadConnectionIndex==-1)
-					deadConnectionIndex=i;
-			}
+			RakAssert(calledFromNetworkThread==false || remoteSystemList[index].systemAddress==systemAddress);
+			return remoteSystemList + index;
 		}
-
-		if (deadConnectionIndex!=-1 && onlyActive==false)
-			return remoteSystemList + deadConnectionIndex;
 	}
 
 	return 0;
@@ -3942,7 +4244,8 @@ void RakPeer::NotifyAndFlagForShutdown( const SystemAddress systemAddress, bool
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 unsigned short RakPeer::GetNumberOfRemoteInitiatedConnections( void ) const
 {
-	unsigned short i, numberOfIncomingConnections;
+	unsigned int i, activeIndex;
+	unsigned short numberOfIncomingConnections;
 
 	if ( remoteSystemList == 0 || endThreads == true )
 		return 0;
@@ -3950,9 +4253,10 @@ unsigned short RakPeer::GetNumberOfRemoteInitiatedConnections( void ) const
 	numberOfIncomingConnections = 0;
 
 	// remoteSystemList in network thread
-	for ( i = 0; i < maximumNumberOfPeers; i++ )
 	//for ( i = 0; i < remoteSystemListSize; i++ )
+	for ( activeIndex = 0; activeIndex < activeSystemListSize; activeIndex++ )
 	{
+		i = activeSystemList[ activeIndex ];
 		if ( remoteSystemList[ i ].isActive && remoteSystemList[ i ].weInitiatedTheConnection == false && remoteSystemList[i].connectMode==RemoteSystemStruct::CONNECTED)
 			numberOfIncomingConnections++;
 	}
@@ -3974,8 +4278,9 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 	{
 		if (IsLoopbackAddress(systemAddress,false)==false)
 		{
-			for ( i = 0; i < maximumNumberOfPeers; i++ )
+			for ( j = 0; j < activeSystemListSize; j++ )
 			{
+				i = activeSystemList[ j ];
 				if ( remoteSystemList[ i ].isActive==true &&
 					remoteSystemList[ i ].systemAddress.binaryAddress==systemAddress.binaryAddress &&
 					time >= remoteSystemList[ i ].connectionTime &&
@@ -4006,6 +4311,7 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 			remoteSystem->MTUSize=defaultMTUSize;
 			remoteSystem->guid=guid;
 			remoteSystem->isActive = true; // This one line causes future incoming packets to go through the reliability layer
+			AddToActiveSystemList(assignedIndex);
 			// Reserve this reliability layer for ourselves.
 			if (incomingMTU > remoteSystem->MTUSize)
 				remoteSystem->MTUSize=incomingMTU;
@@ -4082,6 +4388,13 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 							socketList.Push(rns, __FILE__, __LINE__ );
 							remoteSystem->rakNetSocket=rns;
 
+#if defined(RAKNET_SUPPORT_EPOLL)
+							// The receive threads already running pick this socket up
+							if (receiveThreadCount>0)
+								AddSocketToReceiveEpoll(rns->s);
+							else
+#endif
+							{
 							RakPeerAndIndex rpai;
 							rpai.remotePortRakNetWasStartedOn_PS3=rns->remotePortRakNetWasStartedOn_PS3;
 							rpai.s=rns->s;
@@ -4100,6 +4413,7 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 							RakAssert(errorCode!=0);
 							while (  isRecvFromLoopThreadActive == false )
 								RakSleep(10);
+							}
 
 
 							/*
@@ -4205,85 +4519,29 @@ unsigned int RakPeer::RemoteSystemLookupHashIndex(SystemAddress sa) const
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ReferenceRemoteSystem(SystemAddress sa, unsigned int remoteSystemListIndex)
 {
-// #ifdef _DEBUG
-// 	for ( int remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; ++remoteSystemIndex )
-// 	{
-// 		if (remoteSystemList[remoteSystemIndex].isActive )
-// 		{
-// 			unsigned int hashIndex = GetRemoteSystemIndex(remoteSystemList[remoteSystemIndex].systemAddress);
-// 			RakAssert(hashIndex==remoteSystemIndex);
-// 		}
-// 	}
-// #endif
-
+	// Only the network thread writes the lookup. Readers on other threads retry if the sequence changed while they looked
+	remoteSystemLookupSequence++;
+	RemoteSystemLookupBarrier();
 
-	SystemAddress oldAddress = remoteSystemList[remoteSystemListIndex].systemAddress;
-	if (oldAddress!=UNASSIGNED_SYSTEM_ADDRESS)
-	{
-		// The system might be active if rerouting
-//		RakAssert(remoteSystemList[remoteSystemListIndex].isActive==false);
-		
-		// Remove the reference if the reference is pointing to this inactive system
-		if (GetRemoteSystem(oldAddress)==&remoteSystemList[remoteSystemListIndex])
-			DereferenceRemoteSystem(oldAddress);
-	}
+	// The system might be active if rerouting
+	UnlinkRemoteSystemLookupEntry(remoteSystemListIndex);
 	DereferenceRemoteSystem(sa);
 
-// #ifdef _DEBUG
-// 	for ( int remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; ++remoteSystemIndex )
-// 	{
-// 		if (remoteSystemList[remoteSystemIndex].isActive )
-// 		{
-// 			unsigned int hashIndex = GetRemoteSystemIndex(remoteSystemList[remoteSystemIndex].systemAddress);
-// 			if (hashIndex!=remoteSystemIndex)
-// 			{
-// 				RakAssert(hashIndex==remoteSystemIndex);
-// 			}
-// 		}
-// 	}
-// #endif
-
-
 	remoteSystemList[remoteSystemListIndex].systemAddress=sa;
 
 	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
-	RemoteSystemIndex *rsi;
-	rsi = remoteSystemIndexPool.Allocate(__FILE__,__LINE__);
-	if (remoteSystemLookup[hashIndex]==0)
-	{
-		rsi->next=0;
-		rsi->index=remoteSystemListIndex;
-		remoteSystemLookup[hashIndex]=rsi;
-	}
-	else
-	{
-		RemoteSystemIndex *cur = remoteSystemLookup[hashIndex];
-		while (cur->next!=0)
-		{
-			cur=cur->next;
-		}
-
-		rsi = remoteSystemIndexPool.Allocate(__FILE__,__LINE__);
-		rsi->next=0;
-		rsi->index=remoteSystemListIndex;
-		cur->next=rsi;
-	}
-
-// #ifdef _DEBUG
-// 	for ( int remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; ++remoteSystemIndex )
-// 	{
-// 		if (remoteSystemList[remoteSystemIndex].isActive )
-// 		{
-// 			unsigned int hashIndex = GetRemoteSystemIndex(remoteSystemList[remoteSystemIndex].systemAddress);
-// 			RakAssert(hashIndex==remoteSystemIndex);
-// 		}
-// 	}
-// #endif
+	RemoteSystemIndex *rsi = remoteSystemLookupEntries + remoteSystemListIndex;
+	rsi->next=remoteSystemLookup[hashIndex];
+	remoteSystemLookup[hashIndex]=rsi;
 
+	RemoteSystemLookupBarrier();
+	remoteSystemLookupSequence++;
 
 	RakAssert(GetRemoteSystemIndex(sa)==remoteSystemListIndex);	
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Called from ReferenceRemoteSystem, with the sequence lock held
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::DereferenceRemoteSystem(SystemAddress sa)
 {
 	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
@@ -4301,7 +4559,35 @@ void RakPeer::DereferenceRemoteSystem(SystemAddress sa)
 			{
 				last->next=cur->next;
 			}
-			remoteSystemIndexPool.Release(cur,__FILE__,__LINE__);
+			cur->next=0;
+			break;
+		}
+		last=cur;
+		cur=cur->next;
+	}
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Removes the entry of this slot from the chain of its current address, if it is in it
+// Called from ReferenceRemoteSystem, with the sequence lock held
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::UnlinkRemoteSystemLookupEntry(unsigned int remoteSystemListIndex)
+{
+	if (remoteSystemList[remoteSystemListIndex].systemAddress==UNASSIGNED_SYSTEM_ADDRESS)
+		return;
+
+	RemoteSystemIndex *entry = remoteSystemLookupEntries + remoteSystemListIndex;
+	unsigned int hashIndex = RemoteSystemLookupHashIndex(remoteSystemList[remoteSystemListIndex].systemAddress);
+	RemoteSystemIndex *cur = remoteSystemLookup[hashIndex];
+	RemoteSystemIndex *last = 0;
+	while (cur!=0)
+	{
+		if (cur==entry)
+		{
+			if (last==0)
+				remoteSystemLookup[hashIndex]=cur->next;
+			else
+				last->next=cur->next;
+			cur->next=0;
 			break;
 		}
 		last=cur;
@@ -4322,6 +4608,44 @@ unsigned int RakPeer::GetRemoteSystemIndex(SystemAddress sa) const
 	return (unsigned int) -1;
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Walks the chain without locking, and walks it again if the network thread changed the lookup meanwhile.
+// Chain entries are never freed while running, so a chain changed under us can only give a wrong answer, which the sequence check catches
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+unsigned int RakPeer::GetRemoteSystemIndexFromUserThread(SystemAddress sa) const
+{
+	unsigned int sequence, index, count;
+	RemoteSystemIndex *cur;
+
+	if (remoteSystemLookup==0)
+		return (unsigned int) -1;
+
+	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
+	for (;;)
+	{
+		sequence=remoteSystemLookupSequence;
+		if (sequence & 1)
+			continue;
+		RemoteSystemLookupBarrier();
+
+		index=(unsigned int) -1;
+		cur=remoteSystemLookup[hashIndex];
+		// A chain being relinked can briefly loop, so stop after visiting every slot
+		for (count=0; cur!=0 && count < maximumNumberOfPeers; count++)
+		{
+			if (remoteSystemList[cur->index].systemAddress==sa)
+			{
+				index=cur->index;
+				break;
+			}
+			cur=cur->next;
+		}
+
+		RemoteSystemLookupBarrier();
+		if (remoteSystemLookupSequence==sequence)
+			return index;
+	}
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 RakPeer::RemoteSystemStruct* RakPeer::GetRemoteSystem(SystemAddress sa) const
 {
 	unsigned int remoteSystemIndex = GetRemoteSystemIndex(sa);
@@ -4332,9 +4656,34 @@ RakPeer::RemoteSystemStruct* RakPeer::GetRemoteSystem(SystemAddress sa) const
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ClearRemoteSystemLookup(void)
 {
-	remoteSystemIndexPool.Clear(__FILE__,__LINE__);
-	RakNet::OP_DELETE_ARRAY(remoteSystemLookup,__FILE__,__LINE__);
+	RemoteSystemIndex **temp = remoteSystemLookup;
 	remoteSystemLookup=0;
+	RakNet::OP_DELETE_ARRAY(temp,__FILE__,__LINE__);
+	RakNet::OP_DELETE_ARRAY(remoteSystemLookupEntries,__FILE__,__LINE__);
+	remoteSystemLookupEntries=0;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Called from the network thread when remoteSystemList[remoteSystemListIndex].isActive becomes true
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::AddToActiveSystemList(unsigned int remoteSystemListIndex)
+{
+	RakAssert(activeSystemListSize < maximumNumberOfPeers);
+	remoteSystemList[remoteSystemListIndex].activeSystemListIndex=activeSystemListSize;
+	activeSystemList[activeSystemListSize]=remoteSystemListIndex;
+	activeSystemListSize++;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Called from the network thread when remoteSystemList[remoteSystemListIndex].isActive becomes false
+// Moves the last entry into the hole, so the list stays dense
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::RemoveFromActiveSystemList(unsigned int remoteSystemListIndex)
+{
+	unsigned int activeIndex = remoteSystemList[remoteSystemListIndex].activeSystemListIndex;
+	unsigned int lastIndex = activeSystemList[activeSystemListSize-1];
+	RakAssert(activeIndex < activeSystemListSize && activeSystemList[activeIndex]==remoteSystemListIndex);
+	activeSystemList[activeIndex]=lastIndex;
+	remoteSystemList[lastIndex].activeSystemListIndex=activeIndex;
+	activeSystemListSize--;
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 /*
@@ -5033,6 +5382,7 @@ void RakPeer::CloseConnectionInternal( const AddressOrGUID& systemIdentifier, bo
 				{
 					// Found the index to stop
 					remoteSystemList[index].isActive = false;
+					RemoveFromActiveSystemList(index);
 
 					remoteSystemList[index].guid=UNASSIGNED_RAKNET_GUID;
 
@@ -5253,9 +5603,10 @@ bool RakPeer::SendImmediate( char *data, BitSize_t numberOfBitsToSend, PacketPri
 #endif
 
 		// remoteSystemList in network thread
-		unsigned int idx;
-		for ( idx = 0; idx < maximumNumberOfPeers; idx++ )
+		unsigned int idx, activeIndex;
+		for ( activeIndex = 0; activeIndex < activeSystemListSize; activeIndex++ )
 		{
+			idx = activeSystemList[ activeIndex ];
 			if (remoteSystemIndex!=(unsigned int) -1 && idx==remoteSystemIndex)
 				continue;
 
@@ -5318,6 +5669,39 @@ bool RakPeer::SendImmediate( char *data, BitSize_t numberOfBitsToSend, PacketPri
 	return callerDataAllocationUsed;
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Network thread half of SendWithHeader. Only sends to one system, SendWithHeader copies broadcasts
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool RakPeer::SendImmediateWithHeader( BufferedCommandStruct *bcs, RakNetTimeUS currentTime )
+{
+	unsigned int remoteSystemIndex;
+	if (bcs->systemIdentifier.systemAddress!=UNASSIGNED_SYSTEM_ADDRESS)
+		remoteSystemIndex=GetIndexFromSystemAddress( bcs->systemIdentifier.systemAddress, true );
+	else
+		remoteSystemIndex=GetSystemIndexFromGuid(bcs->systemIdentifier.rakNetGuid);
+
+	if (remoteSystemIndex==(unsigned int) -1)
+		return false;
+
+	RemoteSystemStruct *remoteSystem = remoteSystemList + remoteSystemIndex;
+	if (remoteSystem->isActive==false ||
+		remoteSystem->connectMode==RemoteSystemStruct::DISCONNECT_ASAP ||
+		remoteSystem->connectMode==RemoteSystemStruct::DISCONNECT_ASAP_SILENTLY ||
+		remoteSystem->connectMode==RemoteSystemStruct::DISCONNECT_ON_NO_ACK)
+		return false;
+
+	remoteSystem->reliabilityLayer.SendWithHeader( bcs->header, bcs->headerLength, bcs->refCountedData, bcs->payload, bcs->numberOfBitsToSend, bcs->priority, bcs->reliability, bcs->orderingChannel, remoteSystem->MTUSize, currentTime, bcs->receipt );
+
+	if (bcs->reliability==RELIABLE ||
+		bcs->reliability==RELIABLE_ORDERED ||
+		bcs->reliability==RELIABLE_SEQUENCED ||
+		bcs->reliability==RELIABLE_WITH_ACK_RECEIPT ||
+		bcs->reliability==RELIABLE_ORDERED_WITH_ACK_RECEIPT
+		)
+		remoteSystem->lastReliableSend=(RakNetTime)(currentTime/(RakNetTimeUS)1000);
+
+	return true;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ResetSendReceipt(void)
 {
 	sendReceiptSerialMutex.Lock();
@@ -5334,6 +5718,8 @@ void RakPeer::ClearBufferedCommands(void)
 	{
 		if (bcs->data)
 			rakFree_Ex(bcs->data, __FILE__, __LINE__ );
+		if (bcs->command==BufferedCommandStruct::BCS_RELEASE_PACKET_DATA)
+			ReliabilityLayer::ReleasePacketData(bcs->refCountedData, __FILE__, __LINE__ );
 
 		bufferedCommands.Deallocate(bcs, __FILE__,__LINE__);
 	}
@@ -5343,6 +5729,8 @@ void RakPeer::ClearBufferedCommands(void)
 	{
 		if (bcs->data)
 			rakFree_Ex(bcs->data, __FILE__, __LINE__ );
+		if (bcs->command==BufferedCommandStruct::BCS_RELEASE_PACKET_DATA)
+			ReliabilityLayer::ReleasePacketData(bcs->refCountedData, __FILE__, __LINE__ );
 
 		bufferedCommands.ReadUnlock();
 	}
@@ -5390,6 +5778,7 @@ inline void RakPeer::AddPacketToProducer(Packet *p)
 	packetReturnMutex.Lock();
 	packetReturnQueue.Push(p,__FILE__,__LINE__);
 	packetReturnMutex.Unlock();
+	packetReturnEvent.SetEvent();
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::GenerateGUID(void)
@@ -5440,11 +5829,8 @@ bool ProcessOfflineNetworkPacket( const SystemAddress systemAddress, const char
 	Packet *packet;
 	unsigned i;
 
-	struct sockaddr_in saRemote;
-	unsigned short rcvPort = 0;
-	socklen_t saLength = sizeof(saRemote);
-	if (getsockname(rakNetSocket->s, (sockaddr*)&saRemote, &saLength) == 0)
-		rcvPort = (unsigned short)ntohs(saRemote.sin_port);
+	// Port the datagram arrived on. Resolved once when the socket was bound, rather than calling getsockname per datagram
+	const unsigned short rcvPort = rakNetSocket->boundAddress.port;
 
 #if !defined(_XBOX) && !defined(X360)
 	char str1[64];
@@ -5936,11 +6322,8 @@ void ProcessNetworkPacket( const SystemAddress systemAddress, const char *data,
 		return;
 	}
 
-	struct sockaddr_in saRemote;
-	unsigned short rcvPort = 0;
-	socklen_t saLength = sizeof(saRemote);
-	if (getsockname(rakNetSocket->s, (sockaddr*)&saRemote, &saLength) == 0)
-		rcvPort = (unsigned short)ntohs(saRemote.sin_port);
+	// Port the datagram arrived on. Resolved once when the socket was bound, rather than calling getsockname per datagram
+	const unsigned short rcvPort = rakNetSocket->boundAddress.port;
 
 	Packet *packet;
 	RakPeer::RemoteSystemStruct *remoteSystem;
@@ -6042,7 +6425,7 @@ unsigned int RakPeer::GetRakNetSocketFromUserConnectionSocketIndex(unsigned int
 bool RakPeer::RunUpdateCycle( void )
 {
 	RakPeer::RemoteSystemStruct * remoteSystem;
-	unsigned remoteSystemIndex;
+	unsigned remoteSystemIndex, activeSystemListIndex;
 	Packet *packet;
 	RakNetTime ping, lastPing;
 	// int currentSentBytes,currentReceivedBytes;
@@ -6052,6 +6435,8 @@ bool RakPeer::RunUpdateCycle( void )
 	BitSize_t bitSize;
 	unsigned int byteSize;
 	unsigned char *data;
+	PacketReliability reliability;
+	unsigned char orderingChannel;
 	RakNetTimeUS timeNS;
 	RakNetTime timeMS;
 	SystemAddress systemAddress;
@@ -6166,6 +6551,20 @@ bool RakPeer::RunUpdateCycle( void )
 					remoteSystem->connectMode=bcs->connectionMode;
 			}
 		}
+		else if (bcs->command==BufferedCommandStruct::BCS_SEND_WITH_HEADER)
+		{
+			if (timeNS==0)
+			{
+				timeNS = RakNet::GetTimeNS();
+				timeMS = (RakNetTime)(timeNS/(RakNetTimeUS)1000);
+			}
+
+			SendImmediateWithHeader(bcs, timeNS);
+		}
+		else if (bcs->command==BufferedCommandStruct::BCS_RELEASE_PACKET_DATA)
+		{
+			ReliabilityLayer::ReleasePacketData(bcs->refCountedData, __FILE__, __LINE__ );
+		}
 		else if (bcs->command==BufferedCommandStruct::BCS_CLOSE_CONNECTION)
 		{
 			CloseConnectionInternal(bcs->systemIdentifier, false, true, bcs->orderingChannel, bcs->priority);
@@ -6352,10 +6751,31 @@ bool RakPeer::RunUpdateCycle( void )
 		requestedConnectionQueueMutex.Unlock();
 	}
 
+	// With update workers, every reliability layer is updated up front and the loop below only handles the results
+	bool remoteSystemsUpdated=false;
+	if (updateThreadCount>0)
+	{
+		if (timeNS==0)
+		{
+			timeNS = RakNet::GetTimeNS();
+			timeMS = (RakNetTime)(timeNS/(RakNetTimeUS)1000);
+		}
+
+		UpdateRemoteSystemsParallel(timeNS);
+		remoteSystemsUpdated=true;
+	}
+
 	// remoteSystemList in network thread
-	for ( remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; ++remoteSystemIndex )
 	//for ( remoteSystemIndex = 0; remoteSystemIndex < remoteSystemListSize; ++remoteSystemIndex )
+	// Walk activeSystemList backwards. Closing a connection moves the last entry into its place, which was already visited.
+	// Systems added during the loop are appended past the start and wait for the next cycle
+	for ( activeSystemListIndex = activeSystemListSize; activeSystemListIndex-- > 0; )
 	{
+		// Several connections were closed at once
+		if ( activeSystemListIndex >= activeSystemListSize )
+			continue;
+		remoteSystemIndex = activeSystemList[ activeSystemListIndex ];
+
 		// I'm using systemAddress from remoteSystemList but am not locking it because this loop is called very frequently and it doesn't
 		// matter if we miss or do an extra update.  The reliability layers themselves never care which player they are associated with
 		//systemAddress = remoteSystemList[ remoteSystemIndex ].systemAddress;
@@ -6397,7 +6817,9 @@ bool RakPeer::RunUpdateCycle( void )
 				}
 			}
 
-			remoteSystem->reliabilityLayer.Update( remoteSystem->rakNetSocket->s, systemAddress, remoteSystem->MTUSize, timeNS, maxOutgoingBPS, messageHandlerList, &rnr, remoteSystem->rakNetSocket->remotePortRakNetWasStartedOn_PS3 ); // systemAddress only used for the internet simulator test
+			// A keep alive ping queued above goes out with the next parallel update
+			if (remoteSystemsUpdated==false)
+				remoteSystem->reliabilityLayer.Update( remoteSystem->rakNetSocket->s, systemAddress, remoteSystem->MTUSize, timeNS, maxOutgoingBPS, messageHandlerList, &rnr, remoteSystem->rakNetSocket->remotePortRakNetWasStartedOn_PS3 ); // systemAddress only used for the internet simulator test
 
 			// Check for failure conditions
 			if ( remoteSystem->reliabilityLayer.IsDeadConnection() ||
@@ -6482,7 +6904,7 @@ bool RakPeer::RunUpdateCycle( void )
 
 			// Does the reliability layer have any packets waiting for us?
 			// To be thread safe, this has to be called in the same thread as HandleSocketReceiveFromConnectedPlayer
-			bitSize = remoteSystem->reliabilityLayer.Receive( &data );
+			bitSize = remoteSystem->reliabilityLayer.Receive( &data, &reliability, &orderingChannel );
 
 			while ( bitSize > 0 )
 			{
@@ -6640,6 +7062,8 @@ bool RakPeer::RunUpdateCycle( void )
 						packet->guid = remoteSystem->guid;
 						packet->guid.systemIndex=packet->systemAddress.systemIndex;
 						packet->rcvPort = remoteSystem->rcvPort;
+						packet->reliability = reliability;
+						packet->orderingChannel = orderingChannel;
 						AddPacketToProducer(packet);
 					}
 					else if ( (unsigned char) data[ 0 ] == ID_CONNECTED_PONG && byteSize == sizeof(unsigned char)+sizeof(RakNetTime)*2 )
@@ -6903,6 +7327,8 @@ bool RakPeer::RunUpdateCycle( void )
 								packet->guid = remoteSystem->guid;
 								packet->guid.systemIndex=packet->systemAddress.systemIndex;
 								packet->rcvPort = remoteSystem->rcvPort;
+								packet->reliability = reliability;
+								packet->orderingChannel = orderingChannel;
 								AddPacketToProducer(packet);
 
 
@@ -6962,6 +7388,8 @@ bool RakPeer::RunUpdateCycle( void )
 							packet->guid = remoteSystem->guid;
 							packet->guid.systemIndex=packet->systemAddress.systemIndex;
 							packet->rcvPort = remoteSystem->rcvPort;
+							packet->reliability = reliability;
+							packet->orderingChannel = orderingChannel;
 							AddPacketToProducer(packet);
 						}
 						else
@@ -6973,13 +7401,70 @@ bool RakPeer::RunUpdateCycle( void )
 
 				// Does the reliability layer have any more packets waiting for us?
 				// To be thread safe, this has to be called in the same thread as HandleSocketReceiveFromConnectedPlayer
-				bitSize = remoteSystem->reliabilityLayer.Receive( &data );
+				bitSize = remoteSystem->reliabilityLayer.Receive( &data, &reliability, &orderingChannel );
 			}
 		}
 	}
 
+	// Write everything the reliability layers sent this cycle, one system call per socket
+	SocketLayer::Instance()->FlushSendQueue(&sendToQueue);
+
 	return true;
 }
+#if defined(RAKNET_SUPPORT_MMSG)
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Reads up to RAKNET_RECV_BATCH_SIZE datagrams from s into recvFromStructs with one system call, and pushes them to bufferedPackets.
+// Slots that were pushed are set to 0 and refilled on the next call, so reading nothing does not cost an allocation
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+int RakPeer::RecvFromBatchToBufferedPackets( SOCKET s, unsigned short remotePortRakNetWasStartedOn_PS3, RecvFromStruct **recvFromStructs, bool block )
+{
+	char *dataOut[RAKNET_RECV_BATCH_SIZE];
+	int bytesRead[RAKNET_RECV_BATCH_SIZE];
+	SystemAddress systemAddresses[RAKNET_RECV_BATCH_SIZE];
+	bool pushedAny=false;
+	int numRead, i;
+
+	for (i=0; i < RAKNET_RECV_BATCH_SIZE; i++)
+	{
+		if (recvFromStructs[i]==0)
+			recvFromStructs[i]=bufferedPackets.Allocate( __FILE__, __LINE__ );
+		dataOut[i]=recvFromStructs[i]->data;
+	}
+
+	numRead=SocketLayer::RecvFromBatch(s, dataOut, bytesRead, systemAddresses, RAKNET_RECV_BATCH_SIZE, block);
+	RakNetTimeUS timeRead=RakNet::GetTimeUS();
+	for (i=0; i < numRead; i++)
+	{
+		if (bytesRead[i]<=0)
+			continue;
+		recvFromStructs[i]->bytesRead=bytesRead[i];
+		recvFromStructs[i]->systemAddress=systemAddresses[i];
+		recvFromStructs[i]->timeRead=timeRead;
+		recvFromStructs[i]->s=s;
+		recvFromStructs[i]->remotePortRakNetWasStartedOn_PS3=remotePortRakNetWasStartedOn_PS3;
+		RakAssert(recvFromStructs[i]->systemAddress.port);
+		bufferedPackets.Push(recvFromStructs[i]);
+		recvFromStructs[i]=0;
+		pushedAny=true;
+	}
+
+	if (pushedAny)
+		quitAndDataEvents.SetEvent();
+	return numRead;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::DeallocateRecvFromBatch( RecvFromStruct **recvFromStructs )
+{
+	for (int i=0; i < RAKNET_RECV_BATCH_SIZE; i++)
+	{
+		if (recvFromStructs[i])
+		{
+			bufferedPackets.Deallocate(recvFromStructs[i], __FILE__,__LINE__);
+			recvFromStructs[i]=0;
+		}
+	}
+}
+#endif
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 RAK_THREAD_DECLARATION(RecvFromLoop)
 {
@@ -6988,8 +7473,20 @@ RAK_THREAD_DECLARATION(RecvFromLoop)
 	SOCKET s = rpai->s;
 	unsigned short remotePortRakNetWasStartedOn_PS3 = rpai->remotePortRakNetWasStartedOn_PS3;
 
+	rakPeer->recvFromThreadsMutex.Lock();
+	rakPeer->recvFromThreadsActive++;
+	rakPeer->recvFromThreadsMutex.Unlock();
 	rakPeer->isRecvFromLoopThreadActive = true;
-	
+
+#if defined(RAKNET_SUPPORT_MMSG)
+	// Block for the first datagram, and take everything else already waiting with the same call
+	RakPeer::RecvFromStruct *recvFromStructs[RAKNET_RECV_BATCH_SIZE];
+	for (int i=0; i < RAKNET_RECV_BATCH_SIZE; i++)
+		recvFromStructs[i]=0;
+	while ( rakPeer->endThreads == false )
+		rakPeer->RecvFromBatchToBufferedPackets(s, remotePortRakNetWasStartedOn_PS3, recvFromStructs, true);
+	rakPeer->DeallocateRecvFromBatch(recvFromStructs);
+#else
 	RakPeer::RecvFromStruct *recvFromStruct;
 	while ( rakPeer->endThreads == false )
 	{
@@ -7009,9 +7506,75 @@ RAK_THREAD_DECLARATION(RecvFromLoop)
 			rakPeer->bufferedPackets.Deallocate(recvFromStruct, __FILE__,__LINE__);
 		}
 	}
-	rakPeer->isRecvFromLoopThreadActive = false;
+#endif
+	// Shutdown waits on isRecvFromLoopThreadActive and then frees bufferedPackets, so only the last thread out clears it
+	rakPeer->recvFromThreadsMutex.Lock();
+	if (--rakPeer->recvFromThreadsActive==0)
+		rakPeer->isRecvFromLoopThreadActive = false;
+	rakPeer->recvFromThreadsMutex.Unlock();
 	return 0;
 }
+#if defined(RAKNET_SUPPORT_EPOLL)
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+bool RakPeer::AddSocketToReceiveEpoll( SOCKET s )
+{
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	// One shot, so only one receive thread drains a given socket at a time. Rearmed by EpollRecvFromLoop once the socket is empty
+	ev.events=EPOLLIN | EPOLLONESHOT;
+	ev.data.fd=s;
+	return epoll_ctl(receiveEpoll, EPOLL_CTL_ADD, s, &ev)==0;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+RAK_THREAD_DECLARATION(EpollRecvFromLoop)
+{
+	RakPeer * rakPeer = ( RakPeer * ) arguments;
+	struct epoll_event events[32];
+	RakPeer::RecvFromStruct *recvFromStructs[RAKNET_RECV_BATCH_SIZE];
+	int eventCount, eventIndex, numRead, i;
+	SOCKET s;
+
+	for (i=0; i < RAKNET_RECV_BATCH_SIZE; i++)
+		recvFromStructs[i]=0;
+
+	rakPeer->recvFromThreadsMutex.Lock();
+	rakPeer->recvFromThreadsActive++;
+	rakPeer->recvFromThreadsMutex.Unlock();
+	rakPeer->isRecvFromLoopThreadActive = true;
+
+	while ( rakPeer->endThreads == false )
+	{
+		eventCount = epoll_wait(rakPeer->receiveEpoll, events, sizeof(events)/sizeof(events[0]), -1);
+		for (eventIndex=0; eventIndex < eventCount && rakPeer->endThreads == false; eventIndex++)
+		{
+			s = events[eventIndex].data.fd;
+			if (s==rakPeer->receiveWakeEvent)
+				continue;
+
+			// Read until there is nothing left, up to RAKNET_RECV_BATCH_SIZE datagrams per call
+			do
+			{
+				numRead=rakPeer->RecvFromBatchToBufferedPackets(s, 0, recvFromStructs, false);
+			} while (numRead==RAKNET_RECV_BATCH_SIZE);
+
+			struct epoll_event ev;
+			memset(&ev,0,sizeof(ev));
+			ev.events=EPOLLIN | EPOLLONESHOT;
+			ev.data.fd=s;
+			epoll_ctl(rakPeer->receiveEpoll, EPOLL_CTL_MOD, s, &ev);
+		}
+	}
+
+	rakPeer->DeallocateRecvFromBatch(recvFromStructs);
+
+	// Shutdown waits on isRecvFromLoopThreadActive, so only the last thread out clears it
+	rakPeer->recvFromThreadsMutex.Lock();
+	if (--rakPeer->recvFromThreadsActive==0)
+		rakPeer->isRecvFromLoopThreadActive = false;
+	rakPeer->recvFromThreadsMutex.Unlock();
+	return 0;
+}
+#endif
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 RAK_THREAD_DECLARATION(UpdateNetworkLoop)
 {
@@ -7102,6 +7665,109 @@ RAK_THREAD_DECLARATION(UpdateNetworkLoop)
 
 	return 0;
 }
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Calls ReliabilityLayer::Update for every active remote system, using the network thread and the update workers
+// Only called from the network thread, with nothing else touching the reliability layers until it returns
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::UpdateRemoteSystemsParallel( RakNetTimeUS timeNS )
+{
+	unsigned int i, workersBusy;
+
+	updateMutex.Lock();
+	updateTimeNS=timeNS;
+	updateCursor=0;
+	updateCycle++;
+	updateWorkersBusy=updateThreadCount;
+	updateMutex.Unlock();
+
+	for (i=0; i < updateThreadCount; i++)
+		updateWorkers[i].startEvent.SetEvent();
+
+	UpdateRemoteSystemBatches(&rnr, &sendToQueue);
+
+	// Every worker takes part in every cycle, even if the batches ran out before it woke up
+	for (;;)
+	{
+		updateMutex.Lock();
+		workersBusy=updateWorkersBusy;
+		updateMutex.Unlock();
+		if (workersBusy==0)
+			break;
+		updateDoneEvent.WaitOnEvent(10);
+	}
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Takes batches of activeSystemList from updateCursor and updates them until none are left
+// Datagrams go to queue rather than the layer's own send queue, as that belongs to the network thread
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::UpdateRemoteSystemBatches( RakNetRandom *rnr, SendToQueue *queue )
+{
+	unsigned int first, last, activeIndex;
+	RemoteSystemStruct *remoteSystem;
+
+	for (;;)
+	{
+		updateMutex.Lock();
+		first=updateCursor;
+		updateCursor+=RAKNET_UPDATE_BATCH_SIZE;
+		updateMutex.Unlock();
+
+		if (first>=activeSystemListSize)
+			break;
+		last=first+RAKNET_UPDATE_BATCH_SIZE;
+		if (last>activeSystemListSize)
+			last=activeSystemListSize;
+
+		for (activeIndex=first; activeIndex < last; activeIndex++)
+		{
+			remoteSystem = remoteSystemList + activeSystemList[activeIndex];
+			if (remoteSystem->isActive==false)
+				continue;
+
+			if (queue!=&sendToQueue)
+				remoteSystem->reliabilityLayer.SetSendToQueue(queue);
+			remoteSystem->reliabilityLayer.Update( remoteSystem->rakNetSocket->s, remoteSystem->systemAddress, remoteSystem->MTUSize, updateTimeNS, maxOutgoingBPS, messageHandlerList, rnr, remoteSystem->rakNetSocket->remotePortRakNetWasStartedOn_PS3 );
+			if (queue!=&sendToQueue)
+				remoteSystem->reliabilityLayer.SetSendToQueue(&sendToQueue);
+		}
+	}
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+RAK_THREAD_DECLARATION(UpdateWorkerLoop)
+{
+	RakPeer::UpdateWorker *worker = ( RakPeer::UpdateWorker * ) arguments;
+	RakPeer *rakPeer = worker->rakPeer;
+	bool newCycle;
+
+	rakPeer->updateMutex.Lock();
+	rakPeer->updateThreadsActive++;
+	rakPeer->updateMutex.Unlock();
+
+	while ( rakPeer->endUpdateThreads == false )
+	{
+		worker->startEvent.WaitOnEvent(1000);
+
+		rakPeer->updateMutex.Lock();
+		newCycle = worker->cycle!=rakPeer->updateCycle;
+		worker->cycle=rakPeer->updateCycle;
+		rakPeer->updateMutex.Unlock();
+		if (newCycle==false)
+			continue;
+
+		rakPeer->UpdateRemoteSystemBatches(&worker->rnr, &worker->sendToQueue);
+		SocketLayer::Instance()->FlushSendQueue(&worker->sendToQueue);
+
+		rakPeer->updateMutex.Lock();
+		if (--rakPeer->updateWorkersBusy==0)
+			rakPeer->updateDoneEvent.SetEvent();
+		rakPeer->updateMutex.Unlock();
+	}
+
+	rakPeer->updateMutex.Lock();
+	rakPeer->updateThreadsActive--;
+	rakPeer->updateMutex.Unlock();
+	return 0;
+}
 
 #if defined(RMO_NEW_UNDEF_ALLOCATING_QUEUE)
 #pragma pop_macro("new")
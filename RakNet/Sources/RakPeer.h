@@ -25,6 +25,7 @@
 #include "RakNetSmartPtr.h"
 #include "DS_ThreadsafeAllocatingQueue.h"
 #include "SignaledEvent.h"
+#include "Rand.h"
 
 class HuffmanEncodingTree;
 class PluginInterface2;
@@ -67,6 +68,23 @@ public:
 	/// \return False on failure (can't create socket or thread), true on success.
 	bool Startup( unsigned short maxConnections, int _threadSleepTimer, SocketDescriptor *socketDescriptors, unsigned socketDescriptorCount, int threadPriority=-99999 );
 
+	/// \brief Sets how many threads receive from the sockets passed to Startup().
+	/// \details By default (0) one thread blocks in recvfrom for each socket, which does not scale when listening on hundreds of ports.
+	/// With a non-zero count, that many threads wait on all sockets at once with epoll and read each ready socket with recvmmsg.
+	/// Only supported where RAKNET_SUPPORT_EPOLL is defined (Linux). Otherwise the value is ignored.
+	/// \pre Must be called before Startup().
+	/// \param[in] count Number of receive threads, or 0 for one thread per socket.
+	void SetReceiveThreadCount( unsigned int count );
+
+	/// \brief Sets how many worker threads help the network thread update the reliability layers of the remote systems.
+	/// \details By default (0) the network thread calls ReliabilityLayer::Update() for each remote system in turn, which bounds the update cycle with many connections.
+	/// With a non-zero count, the network thread and the workers take batches of RAKNET_UPDATE_BATCH_SIZE systems from a shared cursor until all are updated, each with its own RakNetRandom and send queue.
+	/// Everything else in the update cycle, including the packets returned from Receive(), still runs on the network thread.
+	/// Plugin callbacks made from ReliabilityLayer::Update(), such as OnInternalPacket() and OnAck(), may then run on several threads at once.
+	/// \pre Must be called before Startup().
+	/// \param[in] count Number of worker threads, or 0 to update every system from the network thread.
+	void SetUpdateThreadCount( unsigned int count );
+
 	/// \brief Secures connections though a combination of SHA1, AES128, SYN Cookies, and RSA to prevent connection spoofing, replay attacks, data eavesdropping, packet tampering, and MitM attacks.
 	/// \details If you accept connections, you must call this for the secure connection to be enabled for incoming connections.
 	/// If you are connecting to another system, you can call this with public key values for p,q and e before connecting to prevent MitM.
@@ -256,6 +274,25 @@ public:
 	/// \note Doesn't support the router plugin.
 	uint32_t SendList( const char **data, const int *lengths, const int numParameters, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceipt=0 );
 
+	/// \brief Sends the data of a received message behind a new header, without copying the data.
+	///
+	/// \details 	/// This is equivalent to SendList() with \a header and payloadLength bytes at packet->data+payloadOffset as the two blocks, but the payload is referenced from \a packet.
+	/// DeallocatePacket() can be called right away. The data is freed once every message referencing it has been sent and is no longer needed for resends.
+	/// Broadcasts, loopback sends, headers longer than RAKNET_MAX_SEND_HEADER_SIZE and messages large enough to be split are copied as usual.
+	/// \param[in] header Bytes to send in front of the payload. May be 0 if \a headerLength is 0
+	/// \param[in] headerLength Length of \a header in bytes
+	/// \param[in] packet A message returned by Receive(), which has not been deallocated yet
+	/// \param[in] payloadOffset Number of bytes at the start of packet->data to leave out
+	/// \param[in] payloadLength Number of bytes of packet->data to send from \a payloadOffset on
+	/// \param[in] priority What priority level to send on.  See PacketPriority.h
+	/// \param[in] reliability How reliability to send this data.  See PacketPriority.h
+	/// \param[in] orderingChannel When using ordered or sequenced messages, what channel to order these on. Messages are only ordered relative to other messages on the same stream
+	/// \param[in] systemIdentifier Who to send this packet to, or in the case of broadcasting who not to send it to. Pass either a SystemAddress structure or a RakNetGUID structure. Use UNASSIGNED_SYSTEM_ADDRESS or to specify none
+	/// \param[in] broadcast True to send this packet to all connected systems. If true, then systemAddress specifies who not to send the packet to.
+	/// \param[in] forceReceipt If 0, will automatically determine the receipt number to return. If non-zero, will return what you give it.
+	/// \return 0 on bad input. Otherwise a number that identifies this message. If \a reliability is a type that returns a receipt, on a later call to Receive() you will get ID_SND_RECEIPT_ACKED or ID_SND_RECEIPT_LOSS with bytes 1-4 inclusive containing this number
+	uint32_t SendWithHeader( const char *header, const int headerLength, Packet *packet, const int payloadOffset, const int payloadLength, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceipt=0 );
+
 	/// \brief Gets a message from the incoming message queue.
 	/// \details Use DeallocatePacket() to deallocate the message after you are done with it.
 	/// User-thread functions, such as RPC calls and the plugin function PluginInterface::Update occur here.
@@ -264,6 +301,12 @@ public:
 	/// \sa RakNetTypes.h contains struct Packet.
 	Packet* Receive( void );
 
+	/// \brief Blocks the calling thread until a message is waiting in the incoming message queue, or until \a timeoutMs elapses.
+	/// \details Use this instead of sleeping between calls to Receive(). The network thread wakes the caller as soon as it queues a message, and no CPU is used while idle.
+	/// \param[in] timeoutMs Maximum time to block, in milliseconds. Use a bounded value so plugin updates in Receive() still run periodically.
+	/// \return true if a message is waiting, false on timeout or if the peer is not active.
+	bool WaitForPacket( unsigned int timeoutMs );
+
 	/// \brief Call this to deallocate a message returned by Receive() when you are done handling it.
 	/// \param[in] packet Message to deallocate.	
 	void DeallocatePacket( Packet *packet );
@@ -753,6 +796,7 @@ public:
 	struct RemoteSystemStruct
 	{
 		bool isActive; // Is this structure in use?
+		unsigned int activeSystemListIndex; // Where this structure is in activeSystemList, while isActive is true
 		SystemAddress systemAddress;  /// Their external IP on the internet
 		SystemAddress myExternalSystemAddress;  /// Your external IP on the internet, from their perspective
 		SystemAddress theirInternalSystemAddress[MAXIMUM_NUMBER_OF_INTERNAL_IDS];  /// Their internal IP, behind the LAN
@@ -793,7 +837,11 @@ protected:
 
 	friend RAK_THREAD_DECLARATION(UpdateNetworkLoop);
 	friend RAK_THREAD_DECLARATION(RecvFromLoop);
+#if defined(RAKNET_SUPPORT_EPOLL)
+	friend RAK_THREAD_DECLARATION(EpollRecvFromLoop);
+#endif
 	friend RAK_THREAD_DECLARATION(UDTConnect);
+	friend RAK_THREAD_DECLARATION(UpdateWorkerLoop);
 
 	/*
 #ifdef _WIN32
@@ -868,6 +916,49 @@ protected:
 	volatile bool endThreads;
 	///true if the peer thread is active. 
 	volatile bool isMainLoopThreadActive,isRecvFromLoopThreadActive;
+	/// Number of threads reading from all sockets with epoll. 0 to use one RecvFromLoop thread per socket
+	unsigned int receiveThreadCount;
+	/// Number of RecvFromLoop or EpollRecvFromLoop threads still running. The last one to exit clears isRecvFromLoopThreadActive
+	unsigned int recvFromThreadsActive;
+	SimpleMutex recvFromThreadsMutex;
+
+	/// \internal
+	/// State of one thread helping with the remote system updates, see SetUpdateThreadCount()
+	struct UpdateWorker
+	{
+		RakPeer *rakPeer;
+		RakNetRandom rnr;
+		SendToQueue sendToQueue;
+		/// Set by the network thread when a cycle starts
+		SignaledEvent startEvent;
+		/// Last value of updateCycle this worker took part in
+		unsigned int cycle;
+	};
+	/// Number of UpdateWorkerLoop threads. 0 to update every remote system from the network thread
+	unsigned int updateThreadCount;
+	UpdateWorker *updateWorkers;
+	volatile bool endUpdateThreads;
+	/// Guards the update* members below
+	SimpleMutex updateMutex;
+	unsigned int updateThreadsActive;
+	/// Incremented for each cycle, so a worker knows when it was woken for a new one
+	unsigned int updateCycle;
+	/// Index in activeSystemList of the next batch to update
+	unsigned int updateCursor;
+	/// Workers which have not finished the current cycle yet
+	unsigned int updateWorkersBusy;
+	RakNetTimeUS updateTimeNS;
+	/// Set by the last worker to finish a cycle
+	SignaledEvent updateDoneEvent;
+	void UpdateRemoteSystemsParallel( RakNetTimeUS timeNS );
+	void UpdateRemoteSystemBatches( RakNetRandom *rnr, SendToQueue *queue );
+#if defined(RAKNET_SUPPORT_EPOLL)
+	/// epoll set holding every socket in socketList, plus receiveWakeEvent
+	int receiveEpoll;
+	/// eventfd written on Shutdown to release all threads blocked in epoll_wait
+	int receiveWakeEvent;
+	bool AddSocketToReceiveEpoll( SOCKET s );
+#endif
 	bool occasionalPing;  /// Do we occasionally ping the other systems?*/
 	///Store the maximum number of peers allowed to connect
 	unsigned short maximumNumberOfPeers;
@@ -888,15 +979,29 @@ protected:
 	/// and moving elements in the list by copying pointers variables without affecting running threads, even if they are in the reliability layer
 	RemoteSystemStruct* remoteSystemList;
 
+	/// Indices in remoteSystemList of the structures with isActive set, in no particular order
+	/// Loops over the connected systems go through this list, so they cost the number of connections rather than maximumNumberOfPeers
+	/// Only changed in the network thread. User thread readers should still check isActive, as an entry can move while they read
+	unsigned int *activeSystemList;
+	unsigned int activeSystemListSize;
+	void AddToActiveSystemList(unsigned int remoteSystemListIndex);
+	void RemoveFromActiveSystemList(unsigned int remoteSystemListIndex);
+
 	// Use a hash, with binaryAddress plus port mod length as the index
 	RemoteSystemIndex **remoteSystemLookup;
+	/// Chain entries of remoteSystemLookup, one per remoteSystemList slot, so they stay valid while the user thread walks a chain
+	RemoteSystemIndex *remoteSystemLookupEntries;
+	/// Sequence lock on remoteSystemLookup and remoteSystemList[].systemAddress. Odd while the network thread changes them
+	volatile unsigned int remoteSystemLookupSequence;
 	unsigned int RemoteSystemLookupHashIndex(SystemAddress sa) const;
 	void ReferenceRemoteSystem(SystemAddress sa, unsigned int remoteSystemListIndex);
 	void DereferenceRemoteSystem(SystemAddress sa);
+	void UnlinkRemoteSystemLookupEntry(unsigned int remoteSystemListIndex);
 	RemoteSystemStruct* GetRemoteSystem(SystemAddress sa) const;
 	unsigned int GetRemoteSystemIndex(SystemAddress sa) const;
+	/// Same as GetRemoteSystemIndex, but safe to call from any thread
+	unsigned int GetRemoteSystemIndexFromUserThread(SystemAddress sa) const;
 	void ClearRemoteSystemLookup(void);
-	DataStructures::MemoryPool<RemoteSystemIndex> remoteSystemIndexPool;
 
 //	unsigned int LookupIndexUsingHashIndex(SystemAddress sa) const;
 //	unsigned int RemoteSystemListIndexUsingHashIndex(SystemAddress sa) const;
@@ -989,7 +1094,12 @@ protected:
 		SOCKET socket;
 		unsigned short port;
 		uint32_t receipt;
-		enum {BCS_SEND, BCS_CLOSE_CONNECTION, BCS_GET_SOCKET, BCS_CHANGE_SYSTEM_ADDRESS,/* BCS_USE_USER_SOCKET, BCS_REBIND_SOCKET_ADDRESS, BCS_RPC, BCS_RPC_SHIFT,*/ BCS_DO_NOTHING} command;
+		// For BCS_SEND_WITH_HEADER and BCS_RELEASE_PACKET_DATA. The payload is in refCountedData->sharedDataBlock, and is not owned by the command
+		InternalPacketRefCountedData *refCountedData;
+		char *payload;
+		char header[RAKNET_MAX_SEND_HEADER_SIZE];
+		unsigned char headerLength;
+		enum {BCS_SEND, BCS_SEND_WITH_HEADER, BCS_RELEASE_PACKET_DATA, BCS_CLOSE_CONNECTION, BCS_GET_SOCKET, BCS_CHANGE_SYSTEM_ADDRESS,/* BCS_USE_USER_SOCKET, BCS_REBIND_SOCKET_ADDRESS, BCS_RPC, BCS_RPC_SHIFT,*/ BCS_DO_NOTHING} command;
 	};
 
 	// Single producer single consumer queue using a linked list
@@ -1015,6 +1125,11 @@ protected:
 		SOCKET s;
 		unsigned short remotePortRakNetWasStartedOn_PS3;
 	};
+#if defined(RAKNET_SUPPORT_MMSG)
+	/// Reads a batch of datagrams from \a s into \a recvFromStructs, and pushes them to bufferedPackets. Returns the number read
+	int RecvFromBatchToBufferedPackets( SOCKET s, unsigned short remotePortRakNetWasStartedOn_PS3, RecvFromStruct **recvFromStructs, bool block );
+	void DeallocateRecvFromBatch( RecvFromStruct **recvFromStructs );
+#endif
 
 #ifndef _RAKNET_THREADSAFE
 	DataStructures::SingleProducerConsumer<RecvFromStruct> bufferedPackets;
@@ -1043,6 +1158,7 @@ protected:
 	void SendBuffered( const char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, RemoteSystemStruct::ConnectMode connectionMode, uint32_t receipt );
 	void SendBufferedList( const char **data, const int *lengths, const int numParameters, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, RemoteSystemStruct::ConnectMode connectionMode, uint32_t receipt );
 	bool SendImmediate( char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, bool useCallerDataAllocation, RakNetTimeUS currentTime, uint32_t receipt );
+	bool SendImmediateWithHeader( BufferedCommandStruct *bcs, RakNetTimeUS currentTime );
 	//bool HandleBufferedRPC(BufferedCommandStruct *bcs, RakNetTime time);
 	void ClearBufferedCommands(void);
 	void ClearBufferedPackets(void);
@@ -1143,6 +1259,11 @@ protected:
 
 	SimpleMutex packetReturnMutex;
 	DataStructures::Queue<Packet*> packetReturnQueue;
+	// Set whenever a packet is pushed to packetReturnQueue, so WaitForPacket() can return immediately
+	SignaledEvent packetReturnEvent;
+
+	/// Datagrams written by the reliability layers during RunUpdateCycle, flushed at the end of each cycle
+	SendToQueue sendToQueue;
 	Packet *AllocPacket(unsigned dataSize, const char *file, unsigned int line);
 	Packet *AllocPacket(unsigned dataSize, unsigned char *data, const char *file, unsigned int line);
 
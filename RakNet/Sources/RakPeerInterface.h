@@ -53,6 +53,19 @@ public:
 	/// \return False on failure (can't create socket or thread), true on success.
 	virtual bool Startup( unsigned short maxConnections, int _threadSleepTimer, SocketDescriptor *socketDescriptors, unsigned socketDescriptorCount, int threadPriority=-99999 )=0;
 
+	/// Sets how many threads receive from the sockets passed to Startup()
+	/// 0 (the default) uses one blocking thread per socket. Otherwise that many threads read all sockets with epoll and recvmmsg.
+	/// Ignored unless RAKNET_SUPPORT_EPOLL is defined (Linux)
+	/// \pre Must be called before Startup()
+	/// \param[in] count Number of receive threads, or 0 for one thread per socket
+	virtual void SetReceiveThreadCount( unsigned int count )=0;
+
+	/// Sets how many worker threads help the network thread call ReliabilityLayer::Update() for the remote systems each update cycle
+	/// 0 (the default) updates every system from the network thread. Plugin callbacks made from ReliabilityLayer::Update() may then run on several threads at once
+	/// \pre Must be called before Startup()
+	/// \param[in] count Number of worker threads, or 0 to update every system from the network thread
+	virtual void SetUpdateThreadCount( unsigned int count )=0;
+
 	/// Secures connections though a combination of SHA1, AES128, SYN Cookies, and RSA to prevent connection spoofing, replay attacks, data eavesdropping, packet tampering, and MitM attacks.
 	/// There is a significant amount of processing and a slight amount of bandwidth overhead for this feature.
 	/// If you accept connections, you must call this or else secure connections will not be enabled for incoming connections.
@@ -224,6 +237,25 @@ public:
 	/// \return 0 on bad input. Otherwise a number that identifies this message. If \a reliability is a type that returns a receipt, on a later call to Receive() you will get ID_SND_RECEIPT_ACKED or ID_SND_RECEIPT_LOSS with bytes 1-4 inclusive containing this number
 	virtual uint32_t SendList( const char **data, const int *lengths, const int numParameters, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceipt=0 )=0;
 
+	/// Sends the data of a received message behind a new header, without copying the data.
+	///
+	/// This is equivalent to SendList() with \a header and payloadLength bytes at packet->data+payloadOffset as the two blocks, but the payload is referenced from \a packet.
+	/// DeallocatePacket() can be called right away. The data is freed once every message referencing it has been sent and is no longer needed for resends.
+	/// Broadcasts, loopback sends, headers longer than RAKNET_MAX_SEND_HEADER_SIZE and messages large enough to be split are copied as usual.
+	/// \param[in] header Bytes to send in front of the payload. May be 0 if \a headerLength is 0
+	/// \param[in] headerLength Length of \a header in bytes
+	/// \param[in] packet A message returned by Receive(), which has not been deallocated yet
+	/// \param[in] payloadOffset Number of bytes at the start of packet->data to leave out
+	/// \param[in] payloadLength Number of bytes of packet->data to send from \a payloadOffset on
+	/// \param[in] priority What priority level to send on.  See PacketPriority.h
+	/// \param[in] reliability How reliability to send this data.  See PacketPriority.h
+	/// \param[in] orderingChannel When using ordered or sequenced messages, what channel to order these on. Messages are only ordered relative to other messages on the same stream
+	/// \param[in] systemIdentifier Who to send this packet to, or in the case of broadcasting who not to send it to. Pass either a SystemAddress structure or a RakNetGUID structure. Use UNASSIGNED_SYSTEM_ADDRESS or to specify none
+	/// \param[in] broadcast True to send this packet to all connected systems. If true, then systemAddress specifies who not to send the packet to.
+	/// \param[in] forceReceipt If 0, will automatically determine the receipt number to return. If non-zero, will return what you give it.
+	/// \return 0 on bad input. Otherwise a number that identifies this message. If \a reliability is a type that returns a receipt, on a later call to Receive() you will get ID_SND_RECEIPT_ACKED or ID_SND_RECEIPT_LOSS with bytes 1-4 inclusive containing this number
+	virtual uint32_t SendWithHeader( const char *header, const int headerLength, Packet *packet, const int payloadOffset, const int payloadLength, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceipt=0 )=0;
+
 	/// Gets a message from the incoming message queue.
 	/// Use DeallocatePacket() to deallocate the message after you are done with it.
 	/// User-thread functions, such as RPC calls and the plugin function PluginInterface::Update occur here.
@@ -234,6 +266,12 @@ public:
 	
 	virtual Packet* ReceiveIgnoreRPC( void )=0;
 
+	/// Blocks until a message is waiting in the incoming message queue, or until \a timeoutMs elapses.
+	/// Call this instead of sleeping between calls to Receive(), so messages are handled as soon as they arrive.
+	/// \param[in] timeoutMs Maximum time to block, in milliseconds
+	/// \return true if a message is waiting, false on timeout or if not active
+	virtual bool WaitForPacket( unsigned int timeoutMs )=0;
+
 	/// Call this to deallocate a message returned by Receive() when you are done handling it.
 	/// \param[in] packet The message to deallocate.	
 	virtual void DeallocatePacket( Packet *packet )=0;
@@ -12,6 +12,7 @@
 #include "RakAssert.h"
 #include "Rand.h"
 #include "MessageIdentifiers.h"
+#include "SimpleMutex.h"
 #include <math.h>
 
 // Can't figure out which library has this function on the PS3
@@ -212,6 +213,10 @@ static int waitFlag=-1;
 
 using namespace RakNet;
 
+// Packet data shared by RakPeer::SendWithHeader may be referenced by several reliability layers, which are updated from
+// several threads with RakPeer::SetUpdateThreadCount
+static SimpleMutex packetDataRefCountMutex;
+
 int SplitPacketChannelComp( SplitPacketIdType const &key, SplitPacketChannel* const &data )
 {
 	if (key < data->splitPacketList[0]->splitPacketId)
@@ -268,6 +273,7 @@ ReliabilityLayer::ReliabilityLayer() :
 updateBitStream( MAXIMUM_MTU_SIZE + 21 )   // preallocate the update bitstream so we can avoid a lot of reallocs at runtime
 {
 	freeThreadedMemoryOnNextUpdate = false;
+	sendToQueue = 0;
 
 #if CC_TIME_TYPE_BYTES==4
 #else
@@ -1102,7 +1108,7 @@ CONTINUE_SOCKET_DATA_PARSE_LOOP:
 //-------------------------------------------------------------------------------------------------------
 // This gets an end-user packet already parsed out. Returns number of BITS put into the buffer
 //-------------------------------------------------------------------------------------------------------
-BitSize_t ReliabilityLayer::Receive( unsigned char **data )
+BitSize_t ReliabilityLayer::Receive( unsigned char **data, PacketReliability *reliability, unsigned char *orderingChannel )
 {
 	// Wait until the clear occurs
 	if (freeThreadedMemoryOnNextUpdate)
@@ -1120,6 +1126,12 @@ BitSize_t ReliabilityLayer::Receive( unsigned char **data )
 		BitSize_t bitLength;
 		*data = internalPacket->data;
 		bitLength = internalPacket->dataBitLength;
+		// Receipts and progress notifications are generated locally and do not set a reliability
+		if ( internalPacket->reliability >= NUMBER_OF_RELIABILITIES || internalPacket->reliability < 0 )
+			*reliability = RELIABLE_ORDERED;
+		else
+			*reliability = internalPacket->reliability;
+		*orderingChannel = internalPacket->orderingChannel < NUMBER_OF_ORDERED_STREAMS ? internalPacket->orderingChannel : 0;
 		ReleaseToInternalPacketPool( internalPacket );
 		return bitLength;
 	}
@@ -1194,6 +1206,66 @@ bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPri
 		AllocInternalPacketData(internalPacket, (unsigned char*) data );
 	}
 
+	return QueueOutgoingPacket( internalPacket, numberOfBitsToSend, priority, reliability, orderingChannel, receipt );
+}
+//-------------------------------------------------------------------------------------------------------
+// Puts data on the send queue behind header, referencing data in a Packet shared by RakPeer::SendWithHeader rather than copying it
+//-------------------------------------------------------------------------------------------------------
+bool ReliabilityLayer::SendWithHeader( const char *header, unsigned int headerLength, InternalPacketRefCountedData *refCountedData, char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, int MTUSize, CCTimeType currentTime, uint32_t receipt )
+{
+	unsigned int numberOfBytesToSend=headerLength+(unsigned int) BITS_TO_BYTES(numberOfBitsToSend);
+	unsigned int maxDataSizeBytes = GetMaxDatagramSizeExcludingMessageHeaderBytes() - BITS_TO_BYTES(GetMaxMessageHeaderLengthBits());
+
+	// Split packets reference their parts by offset into one block, so header and data have to be contiguous
+	if (headerLength > RAKNET_MAX_SEND_HEADER_SIZE || numberOfBytesToSend > maxDataSizeBytes)
+	{
+		char *aggregate = (char*) rakMalloc_Ex( numberOfBytesToSend, __FILE__, __LINE__ );
+		if (aggregate==0)
+		{
+			notifyOutOfMemory(__FILE__, __LINE__);
+			return false;
+		}
+		memcpy(aggregate, header, headerLength);
+		memcpy(aggregate+headerLength, data, numberOfBytesToSend-headerLength);
+		return Send( aggregate, BYTES_TO_BITS(numberOfBytesToSend), priority, reliability, orderingChannel, false, MTUSize, currentTime, receipt );
+	}
+
+#if CC_TIME_TYPE_BYTES==4
+	currentTime/=1000;
+#endif
+
+	// Fix any bad parameters
+	if ( reliability > RELIABLE_ORDERED_WITH_ACK_RECEIPT || reliability < 0 )
+		reliability = RELIABLE;
+
+	if ( priority > NUMBER_OF_PRIORITIES || priority < 0 )
+		priority = HIGH_PRIORITY;
+
+	if ( orderingChannel >= NUMBER_OF_ORDERED_STREAMS )
+		orderingChannel = 0;
+
+	InternalPacket * internalPacket = AllocateFromInternalPacketPool();
+	if (internalPacket==0)
+	{
+		notifyOutOfMemory(__FILE__, __LINE__);
+		return false; // Out of memory
+	}
+
+	bpsMetrics[(int) USER_MESSAGE_BYTES_PUSHED].Push1(currentTime,numberOfBytesToSend);
+
+	internalPacket->creationTime = currentTime;
+	memcpy(internalPacket->headerData, header, headerLength);
+	internalPacket->headerDataLength=(unsigned char) headerLength;
+	AllocInternalPacketData(internalPacket, refCountedData, (unsigned char*) data);
+
+	return QueueOutgoingPacket( internalPacket, BYTES_TO_BITS(numberOfBytesToSend), priority, reliability, orderingChannel, receipt );
+}
+//-------------------------------------------------------------------------------------------------------
+// Assigns ordering to a new message and adds it to the send queue, splitting it if needed
+//-------------------------------------------------------------------------------------------------------
+bool ReliabilityLayer::QueueOutgoingPacket( InternalPacket *internalPacket, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, uint32_t receipt )
+{
+	unsigned int numberOfBytesToSend=(unsigned int) BITS_TO_BYTES(numberOfBitsToSend);
 	internalPacket->dataBitLength = numberOfBitsToSend;
 	internalPacket->messageInternalOrder = internalOrderIndex++;
 	internalPacket->priority = priority;
@@ -1891,7 +1963,7 @@ void ReliabilityLayer::SendBitStream( SOCKET s, SystemAddress systemAddress, Rak
 	bpsMetrics[(int) ACTUAL_BYTES_SENT].Push1(currentTime,length);
 
 	RakAssert(length <= congestionManager.GetMTU());
-	SocketLayer::Instance()->SendTo( s, ( char* ) bitStream->GetData(), length, systemAddress.binaryAddress, systemAddress.port, remotePortRakNetWasStartedOn_PS3 );
+	SocketLayer::Instance()->SendToQueued( sendToQueue, s, ( char* ) bitStream->GetData(), length, systemAddress.binaryAddress, systemAddress.port, remotePortRakNetWasStartedOn_PS3 );
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -1945,6 +2017,12 @@ void ReliabilityLayer::SetUnreliableTimeout(RakNetTimeMS timeoutMS)
 #endif
 }
 
+//-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::SetSendToQueue(SendToQueue *queue)
+{
+	sendToQueue=queue;
+}
+
 //-------------------------------------------------------------------------------------------------------
 // This will return true if we should not send at this time
 //-------------------------------------------------------------------------------------------------------
@@ -2186,7 +2264,13 @@ BitSize_t ReliabilityLayer::WriteToBitStreamFromInternalPacket( RakNet::BitStrea
 	}
 
 	// Write the actual data.
-	bitStream->WriteAlignedBytes( ( unsigned char* ) internalPacket->data, BITS_TO_BYTES( internalPacket->dataBitLength ) );
+	if (internalPacket->headerDataLength>0)
+	{
+		bitStream->WriteAlignedBytes( internalPacket->headerData, internalPacket->headerDataLength );
+		bitStream->WriteAlignedBytes( ( unsigned char* ) internalPacket->data, BITS_TO_BYTES( internalPacket->dataBitLength ) - internalPacket->headerDataLength );
+	}
+	else
+		bitStream->WriteAlignedBytes( ( unsigned char* ) internalPacket->data, BITS_TO_BYTES( internalPacket->dataBitLength ) );
 
 	return bitStream->GetNumberOfBitsUsed() - start;
 }
@@ -3112,6 +3196,7 @@ InternalPacket* ReliabilityLayer::AllocateFromInternalPacketPool(void)
 	ip->splitPacketCount = 0;
 	ip->allocationScheme=InternalPacket::NORMAL;
 	ip->data=0;
+	ip->headerDataLength=0;
 	return ip;
 }
 //-------------------------------------------------------------------------------------------------------
@@ -3277,6 +3362,16 @@ void ReliabilityLayer::AllocInternalPacketData(InternalPacket *internalPacket, I
 	internalPacket->refCountedData=(*refCounter);
 }
 //-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::AllocInternalPacketData(InternalPacket *internalPacket, InternalPacketRefCountedData *packetRefCounter, unsigned char *ourOffset)
+{
+	internalPacket->allocationScheme=InternalPacket::REF_COUNTED_PACKET;
+	internalPacket->data=ourOffset;
+	packetDataRefCountMutex.Lock();
+	packetRefCounter->refCount++;
+	packetDataRefCountMutex.Unlock();
+	internalPacket->refCountedData=packetRefCounter;
+}
+//-------------------------------------------------------------------------------------------------------
 void ReliabilityLayer::AllocInternalPacketData(InternalPacket *internalPacket, unsigned char *externallyAllocatedPtr)
 {
 	internalPacket->allocationScheme=InternalPacket::NORMAL;
@@ -3309,6 +3404,14 @@ void ReliabilityLayer::FreeInternalPacketData(InternalPacket *internalPacket, co
 			internalPacket->refCountedData=0;
 		}
 	}
+	else if (internalPacket->allocationScheme==InternalPacket::REF_COUNTED_PACKET)
+	{
+		if (internalPacket->refCountedData==0)
+			return;
+
+		ReleasePacketData(internalPacket->refCountedData, file, line);
+		internalPacket->refCountedData=0;
+	}
 	else
 	{
 		if (internalPacket->data==0)
@@ -3319,6 +3422,18 @@ void ReliabilityLayer::FreeInternalPacketData(InternalPacket *internalPacket, co
 	}
 }
 //-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::ReleasePacketData(InternalPacketRefCountedData *packetRefCounter, const char *file, unsigned int line)
+{
+	packetDataRefCountMutex.Lock();
+	bool lastReference = --packetRefCounter->refCount==0;
+	packetDataRefCountMutex.Unlock();
+	if (lastReference)
+	{
+		rakFree_Ex(packetRefCounter->sharedDataBlock, file, line );
+		rakFree_Ex(packetRefCounter, file, line );
+	}
+}
+//-------------------------------------------------------------------------------------------------------
 unsigned int ReliabilityLayer::GetMaxDatagramSizeExcludingMessageHeaderBytes(void)
 {
 	// When using encryption, the data may be padded by up to 15 bytes in order to be a multiple of 16.
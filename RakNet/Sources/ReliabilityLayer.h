@@ -137,8 +137,10 @@ public:
 
 	/// This allocates bytes and writes a user-level message to those bytes.
 	/// \param[out] data The message
+	/// \param[out] reliability The reliability the message was sent with
+	/// \param[out] orderingChannel The ordering channel the message was sent on. 0 if the reliability does not use ordering channels
 	/// \return Returns number of BITS put into the buffer
-	BitSize_t Receive( unsigned char**data );
+	BitSize_t Receive( unsigned char**data, PacketReliability *reliability, unsigned char *orderingChannel );
 
 	/// Puts data on the send queue
 	/// \param[in] data The data to send
@@ -153,6 +155,18 @@ public:
 	/// \return True or false for success or failure.
 	bool Send( char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, bool makeDataCopy, int MTUSize, CCTimeType currentTime, uint32_t receipt );
 
+	/// Same as Send, but \a header is sent in front of \a data, and \a data is referenced rather than copied
+	/// \param[in] header Bytes to send in front of \a data. Copied
+	/// \param[in] headerLength Length of \a header in bytes
+	/// \param[in] refCountedData Reference count of the Packet \a data points into. A reference is held until the message is no longer needed. See RakPeer::SendWithHeader
+	/// \param[in] data The data to send, within refCountedData->sharedDataBlock
+	/// \param[in] numberOfBitsToSend The length of \a data in bits
+	/// \return True or false for success or failure.
+	bool SendWithHeader( const char *header, unsigned int headerLength, InternalPacketRefCountedData *refCountedData, char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, int MTUSize, CCTimeType currentTime, uint32_t receipt );
+
+	/// Drops a reference to the data of a Packet shared with SendWithHeader, freeing the data and the reference count on the last one
+	static void ReleasePacketData(InternalPacketRefCountedData *packetRefCounter, const char *file, unsigned int line);
+
 	/// Call once per game cycle.  Handles internal lists and actually does the send.
 	/// \param[in] s the communication  end point
 	/// \param[in] systemAddress The Unique Player Identifier who shouldhave sent some packets
@@ -194,6 +208,8 @@ public:
 
 	void SetSplitMessageProgressInterval(int interval);
 	void SetUnreliableTimeout(RakNetTimeMS timeoutMS);
+	/// Datagrams are queued here and written by the owner with SocketLayer::FlushSendQueue, instead of one sendto per datagram. 0 to send immediately
+	void SetSendToQueue(SendToQueue *queue);
 	/// Has a lot of time passed since the last ack
 	bool AckTimeout(RakNetTimeMS curTime);
 	CCTimeType GetNextSendTime(void) const;
@@ -322,6 +338,7 @@ private:
 	DataStructures::Queue<InternalPacket*> outputQueue;
 	int splitMessageProgressInterval;
 	CCTimeType unreliableTimeout;
+	SendToQueue *sendToQueue;
 
 	struct MessageNumberNode
 	{
@@ -502,6 +519,7 @@ private:
 	// Every 16 datagrams, we make sure the 17th datagram goes out the same update tick, and is the same size as the 16th
 	int countdownToNextPacketPair;
 	InternalPacket* AllocateFromInternalPacketPool(void);
+	bool QueueOutgoingPacket( InternalPacket *internalPacket, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, uint32_t receipt );
 	void ReleaseToInternalPacketPool(InternalPacket *ip);
 
 	DataStructures::RangeList<DatagramSequenceNumberType> acknowlegements;
@@ -513,6 +531,8 @@ private:
 
 	// ourOffset refers to a section within externallyAllocatedPtr. Do not deallocate externallyAllocatedPtr until all references are lost
 	void AllocInternalPacketData(InternalPacket *internalPacket, InternalPacketRefCountedData **refCounter, unsigned char *externallyAllocatedPtr, unsigned char *ourOffset);
+	// ourOffset refers to a section within the Packet data counted by packetRefCounter. Adds a reference, released in FreeInternalPacketData
+	void AllocInternalPacketData(InternalPacket *internalPacket, InternalPacketRefCountedData *packetRefCounter, unsigned char *ourOffset);
 	// Set the data pointer to externallyAllocatedPtr, do not allocate
 	void AllocInternalPacketData(InternalPacket *internalPacket, unsigned char *externallyAllocatedPtr);
 	// Allocate new
@@ -61,10 +61,11 @@ void SignaledEvent::SetEvent(void)
 	::SetEvent(eventList);
 #else
 	// Different from SetEvent which stays signaled.
-	// We have to record manually that the event was signaled
-	isSignaledMutex.Lock();
+	// We have to record manually that the event was signaled.
+	// isSignaled is protected by hMutex, the same mutex the waiter holds while checking it, so the signal cannot be lost between the check and pthread_cond_timedwait
+	pthread_mutex_lock(&hMutex);
 	isSignaled=true;
-	isSignaledMutex.Unlock();
+	pthread_mutex_unlock(&hMutex);
 
 	// Unblock waiting threads
 	pthread_cond_broadcast(&eventList);
@@ -82,64 +83,33 @@ void SignaledEvent::WaitOnEvent(int timeoutMs)
 	WaitForSingleObject(eventList,timeoutMs);
 #else
 
-	// If was previously set signaled, just unset and return
-	isSignaledMutex.Lock();
-	if (isSignaled==true)
-	{
-		isSignaled=false;
-		isSignaledMutex.Unlock();
-		return;
-	}
-	isSignaledMutex.Unlock();
-
-	
 	struct timespec   ts;
 
-	// Else wait for SetEvent to be called
+	// Absolute deadline for pthread_cond_timedwait
 #if defined(_PS3) || defined(__PS3__) || defined(SN_TARGET_PS3)
                                                                                                                                                                                                                                                                                                                                       
 	#else
-		int rc;
 		struct timeval    tp;
-		rc =  gettimeofday(&tp, NULL);
-		ts.tv_sec  = tp.tv_sec;
-		ts.tv_nsec = tp.tv_usec * 1000;
+		gettimeofday(&tp, NULL);
+		ts.tv_sec  = tp.tv_sec + timeoutMs / 1000;
+		ts.tv_nsec = tp.tv_usec * 1000 + (timeoutMs % 1000) * 1000000;
 	#endif
-
-		while (timeoutMs > 30)
+		if (ts.tv_nsec >= 1000000000)
 		{
-			// Wait 30 milliseconds for the signal, then check again.
-			// This is in case we  missed the signal between the top of this function and pthread_cond_timedwait, or after the end of the loop and pthread_cond_timedwait
-			ts.tv_nsec += 30*1000000;
-			if (ts.tv_nsec >= 1000000000)
-			{
-			        ts.tv_nsec -= 1000000000;
-			        ts.tv_sec++;
-			}
-			pthread_cond_timedwait(&eventList, &hMutex, &ts);
-			timeoutMs-=30;
-
-			isSignaledMutex.Lock();
-			if (isSignaled==true)
-			{
-				isSignaled=false;
-				isSignaledMutex.Unlock();
-				return;
-			}
-			isSignaledMutex.Unlock();
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
 		}
 
-		// Wait the remaining time, and turn off the signal in case it was set
-		ts.tv_nsec += timeoutMs*1000000;
-		if (ts.tv_nsec >= 1000000000)
+		pthread_mutex_lock(&hMutex);
+		// If was previously set signaled, this returns immediately. Otherwise wait for SetEvent to be called
+		// Loop because pthread_cond_timedwait may wake up spuriously
+		while (isSignaled==false)
 		{
-		        ts.tv_nsec -= 1000000000;
-		        ts.tv_sec++;
+			if (pthread_cond_timedwait(&eventList, &hMutex, &ts)!=0)
+				break;
 		}
-		pthread_cond_timedwait(&eventList, &hMutex, &ts);
-
-		isSignaledMutex.Lock();
+		// Turn off the signal in case it was set
 		isSignaled=false;
-		isSignaledMutex.Unlock();
+		pthread_mutex_unlock(&hMutex);
 #endif
 }
@@ -31,7 +31,7 @@ protected:
 #ifdef _WIN32
 	HANDLE eventList;
 #else
-	SimpleMutex isSignaledMutex;
+	// Protected by hMutex
 	bool isSignaled;
 #if !defined(ANDROID)
 	pthread_condattr_t condAttr;
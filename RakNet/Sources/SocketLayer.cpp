@@ -704,6 +704,43 @@ void SocketLayer::RawRecvFromNonBlocking( const SOCKET s, unsigned short remoteP
 	}
 }
 
+#if defined(RAKNET_SUPPORT_MMSG)
+int SocketLayer::RecvFromBatch( const SOCKET s, char **dataOut, int *bytesReadOut, SystemAddress *systemAddressOut, int count, bool block )
+{
+	struct mmsghdr msgs[RAKNET_RECV_BATCH_SIZE];
+	struct iovec iovecs[RAKNET_RECV_BATCH_SIZE];
+	sockaddr_in sa[RAKNET_RECV_BATCH_SIZE];
+	int i;
+
+	if (count>RAKNET_RECV_BATCH_SIZE)
+		count=RAKNET_RECV_BATCH_SIZE;
+
+	memset(msgs, 0, sizeof(struct mmsghdr)*count);
+	for (i=0; i < count; i++)
+	{
+		iovecs[i].iov_base=dataOut[i];
+		iovecs[i].iov_len=MAXIMUM_MTU_SIZE;
+		msgs[i].msg_hdr.msg_iov=&iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen=1;
+		msgs[i].msg_hdr.msg_name=&sa[i];
+		msgs[i].msg_hdr.msg_namelen=sizeof(sa[i]);
+	}
+
+	// MSG_WAITFORONE blocks for the first datagram only, then returns it with whatever else is already queued on the socket
+	int numRead = recvmmsg( s, msgs, count, block ? MSG_WAITFORONE : MSG_DONTWAIT, 0 );
+	if (numRead<=0)
+		return 0;
+
+	for (i=0; i < numRead; i++)
+	{
+		bytesReadOut[i]=(int) msgs[i].msg_len;
+		systemAddressOut[i].port=ntohs( sa[i].sin_port );
+		systemAddressOut[i].binaryAddress=sa[i].sin_addr.s_addr;
+	}
+	return numRead;
+}
+#endif
+
 int SocketLayer::SendTo_PS3Lobby( SOCKET s, const char *data, int length, unsigned int binaryAddress, unsigned short port, unsigned short remotePortRakNetWasStartedOn_PS3 )
 {
 	(void) s;
@@ -869,6 +906,93 @@ int SocketLayer::SendTo( SOCKET s, const char *data, int length, unsigned int bi
 
 	return 1; // error
 }
+void SocketLayer::SendToQueued( SendToQueue *queue, SOCKET s, const char *data, int length, unsigned int binaryAddress, unsigned short port, unsigned short remotePortRakNetWasStartedOn_PS3 )
+{
+#if defined(RAKNET_SUPPORT_MMSG)
+	if (queue!=0 && slo==0 && remotePortRakNetWasStartedOn_PS3==0 && s!=(SOCKET) -1)
+	{
+		RakAssert(length<=MAXIMUM_MTU_SIZE-UDP_HEADER_SIZE);
+		RakAssert(port!=0);
+		if (queue->count==RAKNET_SEND_BATCH_SIZE)
+			FlushSendQueue(queue);
+
+		SendToQueue::Datagram *datagram = queue->datagrams + queue->count++;
+		datagram->s=s;
+		datagram->binaryAddress=binaryAddress;
+		datagram->port=port;
+		datagram->length=length;
+		memcpy(datagram->data, data, length);
+		return;
+	}
+#else
+	(void) queue;
+#endif
+
+	SendTo(s, data, length, binaryAddress, port, remotePortRakNetWasStartedOn_PS3);
+}
+void SocketLayer::FlushSendQueue( SendToQueue *queue )
+{
+#if defined(RAKNET_SUPPORT_MMSG)
+	struct mmsghdr msgs[RAKNET_SEND_BATCH_SIZE];
+	struct iovec iovecs[RAKNET_SEND_BATCH_SIZE];
+	sockaddr_in sa[RAKNET_SEND_BATCH_SIZE];
+	bool sent[RAKNET_SEND_BATCH_SIZE];
+	unsigned int first, i, numMsgs, offset;
+	int numSent;
+	SOCKET s;
+
+	for (i=0; i < queue->count; i++)
+		sent[i]=false;
+
+	// Gather the datagrams for each socket in the order they were queued, then write them with one call
+	for (first=0; first < queue->count; first++)
+	{
+		if (sent[first])
+			continue;
+
+		s=queue->datagrams[first].s;
+		numMsgs=0;
+		for (i=first; i < queue->count; i++)
+		{
+			if (sent[i] || queue->datagrams[i].s!=s)
+				continue;
+
+			sa[numMsgs].sin_family = AF_INET;
+			sa[numMsgs].sin_port = htons( queue->datagrams[i].port );
+			sa[numMsgs].sin_addr.s_addr = queue->datagrams[i].binaryAddress;
+			memset(sa[numMsgs].sin_zero, 0, sizeof(sa[numMsgs].sin_zero));
+			iovecs[numMsgs].iov_base=queue->datagrams[i].data;
+			iovecs[numMsgs].iov_len=queue->datagrams[i].length;
+			memset(&msgs[numMsgs], 0, sizeof(msgs[numMsgs]));
+			msgs[numMsgs].msg_hdr.msg_name=&sa[numMsgs];
+			msgs[numMsgs].msg_hdr.msg_namelen=sizeof(sa[numMsgs]);
+			msgs[numMsgs].msg_hdr.msg_iov=&iovecs[numMsgs];
+			msgs[numMsgs].msg_hdr.msg_iovlen=1;
+			numMsgs++;
+			sent[i]=true;
+		}
+
+		offset=0;
+		while (offset < numMsgs)
+		{
+			numSent = sendmmsg( s, msgs+offset, numMsgs-offset, 0 );
+			if (numSent<=0)
+			{
+				if (numSent<0 && errno==EINTR)
+					continue;
+
+				// The datagram at offset failed. Drop it, as SendTo_PC would, and carry on with the rest
+				printf("sendmmsg failed with code %i for char %i and length %i.\n", numSent, ((char*)iovecs[offset].iov_base)[0], (int) iovecs[offset].iov_len);
+				offset++;
+			}
+			else
+				offset+=numSent;
+		}
+	}
+#endif
+
+	queue->count=0;
+}
 int SocketLayer::SendTo( SOCKET s, const char *data, int length, const char ip[ 16 ], unsigned short port, unsigned short remotePortRakNetWasStartedOn_PS3 )
 {
 	unsigned int binaryAddress;
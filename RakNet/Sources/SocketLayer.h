@@ -23,6 +23,25 @@
 
 class RakPeer;
 
+/// Outgoing datagrams held by SocketLayer::SendToQueued() until SocketLayer::FlushSendQueue()
+/// Only one thread may use a given queue, normally the RakPeer network thread
+struct SendToQueue
+{
+	SendToQueue() {count=0;}
+#if defined(RAKNET_SUPPORT_MMSG)
+	struct Datagram
+	{
+		SOCKET s;
+		unsigned int binaryAddress;
+		unsigned short port;
+		int length;
+		char data[MAXIMUM_MTU_SIZE];
+	};
+	Datagram datagrams[RAKNET_SEND_BATCH_SIZE];
+#endif
+	unsigned int count;
+};
+
 class RAK_DLL_EXPORT SocketLayerOverride
 {
 public:
@@ -108,6 +127,18 @@ public:
 	/// \param[out]	timeRead Time that thre read occured
 	void RawRecvFromNonBlocking( const SOCKET s, unsigned short remotePortRakNetWasStartedOn_PS3, char *dataOut, int *bytesReadOut, SystemAddress *systemAddressOut, RakNetTimeUS *timeRead );
 
+#if defined(RAKNET_SUPPORT_MMSG)
+	/// Read up to \a count datagrams from the socket with a single recvmmsg call.
+	/// \param[in] s the socket
+	/// \param[out] dataOut Array of \a count buffers, each MAXIMUM_MTU_SIZE bytes long
+	/// \param[out] bytesReadOut Array of \a count lengths, one per datagram read
+	/// \param[out] systemAddressOut Array of \a count senders, one per datagram read
+	/// \param[in] count Number of entries in each array. Limited to RAKNET_RECV_BATCH_SIZE
+	/// \param[in] block If true, wait for the first datagram then return it with whatever else is already waiting. If false, never wait.
+	/// \return Number of datagrams read, 0 if nothing was read
+	static int RecvFromBatch( const SOCKET s, char **dataOut, int *bytesReadOut, SystemAddress *systemAddressOut, int count, bool block );
+#endif
+
 
 	/// Given a socket and IP, retrieves the subnet mask, on linux the socket is unused
 	/// \param[in] inSock the socket 
@@ -157,6 +188,21 @@ public:
 	/// \return 0 on success, nonzero on failure.
 	int SendTo( SOCKET s, const char *data, int length, unsigned int binaryAddress, unsigned short port, unsigned short remotePortRakNetWasStartedOn_PS3 );
 
+	/// Same as SendTo, but where sendmmsg is supported the datagram is copied to \a queue and written by FlushSendQueue(), together with the other datagrams queued for the same socket.
+	/// Otherwise, or if \a queue is 0, this sends immediately.
+	/// \param[in] queue Queue owned by the calling thread
+	/// \param[in] s Socket to send on
+	/// \param[in] data The datagram
+	/// \param[in] length Length of \a data
+	/// \param[in] binaryAddress The address of the remote host in binary format.
+	/// \param[in] port The port number to send to.
+	/// \param[in] remotePortRakNetWasStartedOn_PS3 Only used on the PS3. Datagrams for the PS3 lobby are never queued
+	void SendToQueued( SendToQueue *queue, SOCKET s, const char *data, int length, unsigned int binaryAddress, unsigned short port, unsigned short remotePortRakNetWasStartedOn_PS3 );
+
+	/// Writes every datagram held in \a queue, with one sendmmsg call per socket, and empties it
+	/// \param[in] queue Queue filled by SendToQueued()
+	void FlushSendQueue( SendToQueue *queue );
+
 	/// Returns the local port, useful when passing 0 as the startup port.
 	/// \param[in] s The socket whose port we are referring to
 	/// \return The local port
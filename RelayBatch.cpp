@@ -0,0 +1,102 @@
+#include "RelayBatch.h"
+#include "ProxyServer.h"
+#include "RakPeerInterface.h"
+
+// ID(1) + length(2) in front of the first message of a batch
+static const int batchHeaderLength = 3;
+
+RelayBatcher::RelayBatcher()
+{
+}
+
+RelayBatcher::~RelayBatcher()
+{
+	for (std::vector<Batch*>::iterator i = pending.begin(); i != pending.end(); i++)
+		delete *i;
+	for (std::vector<Batch*>::iterator i = freeBatches.begin(); i != freeBatches.end(); i++)
+		delete *i;
+}
+
+RelayBatcher::Batch* RelayBatcher::GetBatch(const SystemAddress &target, PacketReliability reliability, unsigned char orderingChannel)
+{
+	Batch *first = targets.Get(target);
+	for (Batch *batch = first; batch; batch = batch->next)
+	{
+		if (batch->reliability == reliability && batch->orderingChannel == orderingChannel)
+			return batch;
+	}
+
+	Batch *batch;
+	if (freeBatches.empty())
+		batch = new Batch;
+	else
+	{
+		batch = freeBatches.back();
+		freeBatches.pop_back();
+	}
+	batch->target = target;
+	batch->reliability = reliability;
+	batch->orderingChannel = orderingChannel;
+	batch->messageCount = 0;
+	batch->stream.Reset();
+	batch->stream.Write((unsigned char)ID_PROXY_BATCH_MESSAGE);
+	if (first)
+	{
+		batch->next = first->next;
+		first->next = batch;
+	}
+	else
+	{
+		batch->next = 0;
+		targets.Insert(target, batch);
+	}
+	pending.push_back(batch);
+	return batch;
+}
+
+void RelayBatcher::Send(RakPeerInterface *sender, Batch *batch)
+{
+	if (batch->messageCount == 1)
+	{
+		// Not worth the batch header
+		sender->Send((const char*)batch->stream.GetData() + batchHeaderLength, batch->stream.GetNumberOfBytesUsed() - batchHeaderLength, HIGH_PRIORITY, batch->reliability, batch->orderingChannel, batch->target, false);
+	}
+	else if (batch->messageCount > 1)
+	{
+		sender->Send(&batch->stream, HIGH_PRIORITY, batch->reliability, batch->orderingChannel, batch->target, false);
+	}
+	batch->messageCount = 0;
+	batch->stream.Reset();
+	batch->stream.Write((unsigned char)ID_PROXY_BATCH_MESSAGE);
+}
+
+bool RelayBatcher::Add(RakPeerInterface *sender, const SystemAddress &target, const char *header, int headerLength, const unsigned char *payload, int payloadLength, PacketReliability reliability, unsigned char orderingChannel)
+{
+	int length = headerLength + payloadLength;
+	Batch *batch = GetBatch(target, reliability, orderingChannel);
+	if (batch->stream.GetNumberOfBytesUsed() + 2 + length > PROXY_MAX_BATCH_SIZE)
+	{
+		Send(sender, batch);
+		if (1 + 2 + length > PROXY_MAX_BATCH_SIZE)
+			return false;
+	}
+
+	batch->stream.Write((unsigned short)length);
+	batch->stream.WriteAlignedBytes((const unsigned char*)header, headerLength);
+	batch->stream.WriteAlignedBytes(payload, payloadLength);
+	batch->messageCount++;
+	return true;
+}
+
+void RelayBatcher::Flush(RakPeerInterface *sender)
+{
+	for (std::vector<Batch*>::iterator i = pending.begin(); i != pending.end(); i++)
+	{
+		Batch *batch = *i;
+		Send(sender, batch);
+		if (targets.Get(batch->target) == batch)
+			targets.Remove(batch->target);
+		freeBatches.push_back(batch);
+	}
+	pending.clear();
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "RelayState.h"
+#include "BitStream.h"
+#include "PacketPriority.h"
+#include <vector>
+
+class RakPeerInterface;
+
+// Relayed messages for servers which accept ID_PROXY_BATCH_MESSAGE, see PROXY_BATCH_PROTOCOL_VERSION.
+//
+// Messages are collected per server, reliability and ordering channel, and each collection is sent as one batch
+// when Flush is called at the end of a relay loop iteration, or as soon as the next message would not fit. A batch
+// holding a single message is sent as that message alone. A batcher is only used from one thread.
+class RelayBatcher
+{
+public:
+	RelayBatcher();
+	~RelayBatcher();
+
+	// Adds header followed by payload to the batch for target. Returns false if the message is too large to be batched, after
+	// sending the batch it would have been added to, so the caller can send the message on its own without reordering it
+	bool Add(RakPeerInterface *sender, const SystemAddress &target, const char *header, int headerLength, const unsigned char *payload, int payloadLength, PacketReliability reliability, unsigned char orderingChannel);
+	// Sends every batch
+	void Flush(RakPeerInterface *sender);
+	bool IsEmpty() const { return pending.empty(); }
+
+private:
+	struct Batch
+	{
+		SystemAddress target;
+		PacketReliability reliability;
+		unsigned char orderingChannel;
+		// Next batch for the same target, with another reliability or ordering channel
+		Batch *next;
+		RakNet::BitStream stream;
+		unsigned int messageCount;
+	};
+
+	Batch* GetBatch(const SystemAddress &target, PacketReliability reliability, unsigned char orderingChannel);
+	void Send(RakPeerInterface *sender, Batch *batch);
+
+	// First batch of each target with messages waiting
+	AddressTable<Batch> targets;
+	std::vector<Batch*> pending;
+	// Batches are reused, so their streams keep their buffers
+	std::vector<Batch*> freeBatches;
+};
@@ -0,0 +1,143 @@
+#include "RelayCoalesce.h"
+#include "ProxyServer.h"
+#include "RakPeerInterface.h"
+#include "RakNetStatistics.h"
+
+RelayCoalescer::RelayCoalescer()
+{
+	keyLength = 0;
+	heldMessageCount = 0;
+	replacedMessageCount = 0;
+}
+
+RelayCoalescer::~RelayCoalescer()
+{
+	for (std::vector<Client*>::iterator i = clientList.begin(); i != clientList.end(); i++)
+		delete *i;
+}
+
+bool RelayCoalescer::GetKey(const unsigned char *data, int offset, int length, PacketReliability reliability, std::string &key) const
+{
+	if (reliability != UNRELIABLE && reliability != UNRELIABLE_SEQUENCED)
+		return false;
+	int idOffset = offset;
+	if (data[idOffset] == ID_TIMESTAMP)
+		idOffset += 5;
+	if (idOffset + 1 + keyLength > offset + length || data[idOffset] != ID_STATE_UPDATE)
+		return false;
+	key.assign((const char*)data + idOffset + 1, keyLength);
+	return true;
+}
+
+RelayCoalescer::Client* RelayCoalescer::GetClient(RakPeerInterface *sender, const SystemAddress &target, RakNetTime now)
+{
+	Client *client = clients.Get(target);
+	if (client == 0)
+	{
+		client = new Client;
+		client->address = target;
+		client->sender = sender;
+		client->congested = false;
+		CheckCongestion(client, now);
+		clients.Insert(target, client);
+		clientList.push_back(client);
+	}
+	else if (now - client->checkTime >= RELAY_COALESCE_CHECK_MS)
+	{
+		client->sender = sender;
+		CheckCongestion(client, now);
+	}
+	return client;
+}
+
+void RelayCoalescer::CheckCongestion(Client *client, RakNetTime now)
+{
+	client->checkTime = now;
+	RakNetStatistics statistics;
+	if (client->sender->GetStatistics(client->address, &statistics) == 0)
+	{
+		client->congested = false;
+		return;
+	}
+	double backlog = 0;
+	for (int i = 0; i < NUMBER_OF_PRIORITIES; i++)
+		backlog += statistics.bytesInSendBuffer[i];
+	if (client->congested)
+		client->congested = backlog >= RELAY_COALESCE_BACKLOG_BYTES / 2;
+	else
+		client->congested = backlog >= RELAY_COALESCE_BACKLOG_BYTES;
+}
+
+void RelayCoalescer::Hold(Client *client, const std::string &key, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel)
+{
+	std::map<std::string, Held>::iterator i = client->held.find(key);
+	if (i == client->held.end())
+	{
+		i = client->held.insert(std::make_pair(key, Held())).first;
+		heldMessageCount++;
+	}
+	else
+		replacedMessageCount++;
+	i->second.message.assign((const char*)data + offset, length);
+	i->second.reliability = reliability;
+	i->second.orderingChannel = orderingChannel;
+}
+
+bool RelayCoalescer::Add(RakPeerInterface *sender, const SystemAddress &target, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now)
+{
+	if (keyLength <= 0 || !GetKey(data, offset, length, reliability, key))
+		return false;
+	Client *client = GetClient(sender, target, now);
+	if (!client->congested)
+		return false;
+	Hold(client, key, data, offset, length, reliability, orderingChannel);
+	return true;
+}
+
+void RelayCoalescer::Add(RakPeerInterface *sender, std::vector<SystemAddress> &targets, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now)
+{
+	if (keyLength <= 0 || !GetKey(data, offset, length, reliability, key))
+		return;
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < targets.size(); i++)
+	{
+		Client *client = GetClient(sender, targets[i], now);
+		if (client->congested)
+			Hold(client, key, data, offset, length, reliability, orderingChannel);
+		else
+			targets[kept++] = targets[i];
+	}
+	targets.resize(kept);
+}
+
+void RelayCoalescer::Update(RakNetTime now)
+{
+	unsigned int i = 0;
+	while (i < clientList.size())
+	{
+		Client *client = clientList[i];
+		if (now - client->checkTime < RELAY_COALESCE_CHECK_MS)
+		{
+			i++;
+			continue;
+		}
+		if (!client->sender->IsConnected(client->address))
+		{
+			heldMessageCount -= client->held.size();
+			clients.Remove(client->address);
+			clientList[i] = clientList.back();
+			clientList.pop_back();
+			delete client;
+			continue;
+		}
+		CheckCongestion(client, now);
+		if (!client->congested && !client->held.empty())
+		{
+			for (std::map<std::string, Held>::iterator h = client->held.begin(); h != client->held.end(); h++)
+				client->sender->Send(h->second.message.data(), (int)h->second.message.length(), HIGH_PRIORITY, h->second.reliability, h->second.orderingChannel, client->address, false);
+			heldMessageCount -= client->held.size();
+			client->held.clear();
+		}
+		i++;
+	}
+}
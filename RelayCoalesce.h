@@ -0,0 +1,75 @@
+#pragma once
+#include "RelayState.h"
+#include "RakNetTime.h"
+#include "PacketPriority.h"
+#include <map>
+#include <string>
+#include <vector>
+
+class RakPeerInterface;
+
+// A client is congested once this many bytes wait in its send buffer, and no longer congested once under half of it
+#define RELAY_COALESCE_BACKLOG_BYTES 16384
+// How often the send buffer of a client is checked
+#define RELAY_COALESCE_CHECK_MS 50
+
+// Latest value coalescing of unreliable ID_STATE_UPDATE messages relayed to congested clients.
+//
+// A client is congested while its send buffer, from RakNetStatistics, is backed up. Unreliable state updates for it
+// are then held instead of sent, keeping only the newest message of each object. The object is named by the key
+// bytes following ID_STATE_UPDATE, so a newer update replaces the one held for the same object. The held messages
+// are sent once the backlog clears. Reliable messages are never held. A coalescer is only used from one thread.
+class RelayCoalescer
+{
+public:
+	RelayCoalescer();
+	~RelayCoalescer();
+
+	// Number of bytes after ID_STATE_UPDATE naming the object. 0 disables coalescing
+	void SetKeyLength(int length) { keyLength = length; }
+	bool IsEnabled() const { return keyLength > 0; }
+
+	// Holds the message, the length bytes of packet data from offset on, if it is an unreliable state update and the
+	// target is congested. Returns false if the caller should send the message itself
+	bool Add(RakPeerInterface *sender, const SystemAddress &target, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now);
+	// Like Add, for each target of a multicast. Removes the targets the message was held for
+	void Add(RakPeerInterface *sender, std::vector<SystemAddress> &targets, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now);
+	// Sends the messages held for the clients which are no longer congested, and forgets disconnected clients
+	void Update(RakNetTime now);
+
+	unsigned int GetHeldMessageCount() const { return heldMessageCount; }
+	// Messages replaced by a newer update of the same object since the coalescer was created
+	unsigned int GetReplacedMessageCount() const { return replacedMessageCount; }
+
+private:
+	struct Held
+	{
+		std::string message;
+		PacketReliability reliability;
+		unsigned char orderingChannel;
+	};
+
+	struct Client
+	{
+		SystemAddress address;
+		RakPeerInterface *sender;
+		bool congested;
+		RakNetTime checkTime;
+		// Object key to its newest update
+		std::map<std::string, Held> held;
+	};
+
+	// Key of the message, or false if it cannot be coalesced
+	bool GetKey(const unsigned char *data, int offset, int length, PacketReliability reliability, std::string &key) const;
+	Client* GetClient(RakPeerInterface *sender, const SystemAddress &target, RakNetTime now);
+	void CheckCongestion(Client *client, RakNetTime now);
+	void Hold(Client *client, const std::string &key, const unsigned char *data, int offset, int length, PacketReliability reliability, unsigned char orderingChannel);
+
+	int keyLength;
+	AddressTable<Client> clients;
+	// Clients in the table, for Update
+	std::vector<Client*> clientList;
+	unsigned int heldMessageCount;
+	unsigned int replacedMessageCount;
+	std::string key;
+};
@@ -0,0 +1,218 @@
+#include "RelayQueue.h"
+#include <stdio.h>
+
+// Smallest size class, in bytes. Each class is twice the size of the previous one
+static const int minClassSize = 64;
+// Bytes of buffers allocated at once for a size class
+static const int slabSize = 16384;
+
+RelayQueue::RelayQueue()
+{
+	oldest = 0;
+	newest = 0;
+	messageCount = 0;
+	byteCount = 0;
+	targetByteLimit = RELAY_QUEUE_TARGET_BYTES;
+	totalByteLimit = RELAY_QUEUE_TOTAL_BYTES;
+	timeout = RELAY_QUEUE_TIMEOUT_MS;
+	for (int i = 0; i < sizeClassCount; i++)
+		freeItems[i] = 0;
+}
+
+RelayQueue::~RelayQueue()
+{
+	while (oldest)
+	{
+		RelayItem *item = oldest;
+		oldest = item->newer;
+		if (item->sizeClass < 0)
+		{
+			delete[] item->packet;
+			delete item;
+		}
+	}
+	for (unsigned int i = 0; i < targets.SlotCount(); i++)
+		delete targets.GetSlot(i);
+	for (std::vector<RelayItem*>::iterator i = itemSlabs.begin(); i != itemSlabs.end(); i++)
+		delete[] *i;
+	for (std::vector<char*>::iterator i = bufferSlabs.begin(); i != bufferSlabs.end(); i++)
+		delete[] *i;
+}
+
+void RelayQueue::SetLimits(unsigned int targetBytes, unsigned int totalBytes, RakNetTime timeoutMS)
+{
+	targetByteLimit = targetBytes;
+	totalByteLimit = totalBytes;
+	timeout = timeoutMS;
+}
+
+RelayItem* RelayQueue::AllocateItem(int length)
+{
+	int sizeClass = 0;
+	while (sizeClass < sizeClassCount && (minClassSize << sizeClass) < length)
+		sizeClass++;
+	if (sizeClass == sizeClassCount)
+	{
+		RelayItem *item = new RelayItem;
+		item->packet = new char[length];
+		item->sizeClass = -1;
+		return item;
+	}
+
+	if (freeItems[sizeClass] == 0)
+	{
+		int classSize = minClassSize << sizeClass;
+		int count = slabSize / classSize;
+		RelayItem *items = new RelayItem[count];
+		char *buffers = new char[count * classSize];
+		itemSlabs.push_back(items);
+		bufferSlabs.push_back(buffers);
+		for (int i = 0; i < count; i++)
+		{
+			items[i].packet = buffers + i * classSize;
+			items[i].sizeClass = sizeClass;
+			items[i].next = freeItems[sizeClass];
+			freeItems[sizeClass] = &items[i];
+		}
+	}
+	RelayItem *item = freeItems[sizeClass];
+	freeItems[sizeClass] = item->next;
+	return item;
+}
+
+void RelayQueue::FreeItem(RelayItem *item)
+{
+	if (item->sizeClass < 0)
+	{
+		delete[] item->packet;
+		delete item;
+		return;
+	}
+	item->next = freeItems[item->sizeClass];
+	freeItems[item->sizeClass] = item;
+}
+
+char* RelayQueue::Add(const SystemAddress &address, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now)
+{
+	Target *target = targets.Get(address);
+	unsigned int targetBytes = target ? target->byteCount : 0;
+	if ((targetByteLimit && targetBytes + length > targetByteLimit) || (totalByteLimit && byteCount + length > totalByteLimit))
+		return 0;
+
+	if (target == 0)
+	{
+		target = new Target;
+		target->address = address;
+		target->first = 0;
+		target->last = 0;
+		target->byteCount = 0;
+		targets.Insert(address, target);
+	}
+
+	RelayItem *item = AllocateItem(length);
+	item->length = length;
+	item->target = address;
+	item->reliability = reliability;
+	item->orderingChannel = orderingChannel;
+	item->queueTime = now;
+	item->next = 0;
+	if (target->last)
+		target->last->next = item;
+	else
+		target->first = item;
+	target->last = item;
+	target->byteCount += length;
+
+	item->newer = 0;
+	item->older = newest;
+	if (newest)
+		newest->newer = item;
+	else
+		oldest = item;
+	newest = item;
+
+	messageCount++;
+	byteCount += length;
+	return item->packet;
+}
+
+RelayItem* RelayQueue::PopFirst(Target *target)
+{
+	RelayItem *item = target->first;
+	target->first = item->next;
+	if (target->first == 0)
+		target->last = 0;
+	target->byteCount -= item->length;
+
+	if (item->older)
+		item->older->newer = item->newer;
+	else
+		oldest = item->newer;
+	if (item->newer)
+		item->newer->older = item->older;
+	else
+		newest = item->older;
+
+	messageCount--;
+	byteCount -= item->length;
+
+	if (target->first == 0)
+	{
+		targets.Remove(target->address);
+		delete target;
+	}
+	return item;
+}
+
+RelayItem* RelayQueue::Take(const SystemAddress &address)
+{
+	Target *target = targets.Get(address);
+	if (target == 0)
+		return 0;
+	// The messages stay linked through next. Popping the last one removes the target
+	RelayItem *first = target->first;
+	for (RelayItem *item = first; item; item = item->next)
+		PopFirst(target);
+	return first;
+}
+
+void RelayQueue::Release(RelayItem *items)
+{
+	while (items)
+	{
+		RelayItem *item = items;
+		items = item->next;
+		FreeItem(item);
+	}
+}
+
+unsigned int RelayQueue::Discard(const SystemAddress &address)
+{
+	RelayItem *items = Take(address);
+	unsigned int count = 0;
+	for (RelayItem *item = items; item; item = item->next)
+		count++;
+	Release(items);
+	return count;
+}
+
+unsigned int RelayQueue::Expire(RakNetTime now)
+{
+	unsigned int count = 0;
+	if (timeout == 0)
+		return 0;
+	// Messages of a target are in queue order, so the oldest message of the queue is the first message of its target
+	while (oldest && now - oldest->queueTime >= timeout)
+	{
+		FreeItem(PopFirst(targets.Get(oldest->target)));
+		count++;
+	}
+	return count;
+}
+
+void RelayQueue::Print() const
+{
+	for (RelayItem *item = oldest; item; item = item->newer)
+		printf("%s ", item->target.ToString());
+	printf("\n");
+}
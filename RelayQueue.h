@@ -0,0 +1,93 @@
+#pragma once
+#include "RelayState.h"
+#include "RakNetTime.h"
+#include "PacketPriority.h"
+#include <vector>
+
+// Default limits of the relay queue, see RelayQueue::SetLimits
+#define RELAY_QUEUE_TARGET_BYTES 65536
+#define RELAY_QUEUE_TOTAL_BYTES 4194304
+#define RELAY_QUEUE_TIMEOUT_MS 15000
+
+struct RelayItem
+{
+	char* packet;
+	int length;
+	SystemAddress target;
+	// Sent with the reliability and ordering channel of the message being relayed
+	PacketReliability reliability;
+	unsigned char orderingChannel;
+	RakNetTime queueTime;
+	// Next message to the same target
+	RelayItem *next;
+	// Every queued message in queue order, oldest first
+	RelayItem *newer;
+	RelayItem *older;
+	// Size class of packet, or -1 if it was allocated for this message alone
+	int sizeClass;
+};
+
+// Messages waiting for the connection to their target to complete.
+//
+// Messages are queued per target, so flushing or discarding the messages of one target does not touch the others.
+// Payloads are carved from slabs of fixed size buffers, one slab list per power of two size class, and freed
+// buffers are reused, so a connect storm does not allocate once the queue has grown to its working size. The
+// bytes queued per target and in total are capped, and messages queued for longer than the timeout are dropped.
+class RelayQueue
+{
+public:
+	RelayQueue();
+	~RelayQueue();
+
+	// 0 means no limit
+	void SetLimits(unsigned int targetBytes, unsigned int totalBytes, RakNetTime timeout);
+
+	// Queues a message of length bytes for target, and returns the buffer to write it to. Returns 0 if the message
+	// would go over the byte limit of the target or of the queue
+	char* Add(const SystemAddress &target, int length, PacketReliability reliability, unsigned char orderingChannel, RakNetTime now);
+	// Removes the messages queued for this target and returns them, oldest first and linked through next. The caller
+	// gives them back with Release
+	RelayItem* Take(const SystemAddress &target);
+	void Release(RelayItem *items);
+	// Returns the number of messages discarded
+	unsigned int Discard(const SystemAddress &target);
+	// Drops the messages queued for longer than the timeout. Returns the number of messages dropped
+	unsigned int Expire(RakNetTime now);
+
+	unsigned int GetMessageCount() const { return messageCount; }
+	unsigned int GetByteCount() const { return byteCount; }
+	// Debug output, printed to stdout like the rest of the relay debug output
+	void Print() const;
+
+private:
+	struct Target
+	{
+		SystemAddress address;
+		RelayItem *first;
+		RelayItem *last;
+		unsigned int byteCount;
+	};
+
+	RelayItem* AllocateItem(int length);
+	void FreeItem(RelayItem *item);
+	// Unlinks the first message of target, and removes target when it has no messages left
+	RelayItem* PopFirst(Target *target);
+
+	AddressTable<Target> targets;
+	RelayItem *oldest;
+	RelayItem *newest;
+	unsigned int messageCount;
+	unsigned int byteCount;
+
+	unsigned int targetByteLimit;
+	unsigned int totalByteLimit;
+	RakNetTime timeout;
+
+	// Buffers of 64 to 4096 bytes. Larger messages are allocated on their own
+	enum { sizeClassCount = 7 };
+	// Free items of each size class, linked through next
+	RelayItem *freeItems[sizeClassCount];
+	// Item and buffer arrays of every slab, freed with the queue
+	std::vector<RelayItem*> itemSlabs;
+	std::vector<char*> bufferSlabs;
+};
@@ -0,0 +1,307 @@
+#include "RelayShard.h"
+#include "ProxyServer.h"
+#include "Log.h"
+#include "BitStream.h"
+#include "RakPeerInterface.h"
+#include "RakNetworkFactory.h"
+#include "RakSleep.h"
+#include <string.h>
+
+RAK_THREAD_DECLARATION(RelayShardLoop);
+
+RelayShard::RelayShard()
+{
+	peer = 0;
+	mainPeer = 0;
+	ownPeer = false;
+	startPort = 0;
+	endPort = 0;
+	endThread = false;
+	isThreadActive = false;
+}
+
+RelayShard::~RelayShard()
+{
+	Shutdown();
+}
+
+void RelayShard::Startup(RakPeerInterface *mainPeer, unsigned short startPort, unsigned short endPort)
+{
+	this->peer = mainPeer;
+	this->mainPeer = mainPeer;
+	this->startPort = startPort;
+	this->endPort = endPort;
+	relayState.SetPortRange(startPort, endPort);
+}
+
+bool RelayShard::Startup(RakPeerInterface *mainPeer, unsigned short startPort, unsigned short endPort, int connectionCount, int receiveThreadCount, int updateThreadCount, const char *password, int passwordLength)
+{
+	Startup(mainPeer, startPort, endPort);
+
+	peer = RakNetworkFactory::GetRakPeerInterface();
+	ownPeer = true;
+	int portCount = endPort - startPort + 1;
+	SocketDescriptor *sds = new SocketDescriptor[portCount];
+	for (int i = 0; i < portCount; i++)
+		sds[i] = SocketDescriptor(startPort + i, 0);
+	if (password)
+		peer->SetIncomingPassword(password, passwordLength);
+	peer->SetReceiveThreadCount(receiveThreadCount);
+	peer->SetUpdateThreadCount(updateThreadCount);
+	bool r = peer->Startup(connectionCount, 10, sds, portCount);
+	delete[] sds;
+	if (!r)
+		return false;
+	peer->SetMaximumIncomingConnections(connectionCount);
+
+	endThread = false;
+	isThreadActive = true;
+	if (RakNet::RakThread::Create(RelayShardLoop, this) != 0)
+	{
+		isThreadActive = false;
+		Log::error_log("Failed to start relay thread for ports %d to %d\n", startPort, endPort);
+		return false;
+	}
+	return true;
+}
+
+void RelayShard::Shutdown()
+{
+	if (!ownPeer)
+		return;
+
+	endThread = true;
+	while (isThreadActive)
+		RakSleep(15);
+
+	peer->Shutdown(100, 0);
+	RakNetworkFactory::DestroyRakPeerInterface(peer);
+	peer = 0;
+	ownPeer = false;
+}
+
+unsigned short RelayShard::AssignPort(const SystemAddress &server, int protocolVersion)
+{
+	mutex.Lock();
+	unsigned short port = relayState.AssignPort(server, protocolVersion);
+	mutex.Unlock();
+	return port;
+}
+
+int RelayShard::GetProtocolVersion(const SystemAddress &server)
+{
+	mutex.Lock();
+	int protocolVersion = relayState.GetProtocolVersion(relayState.GetServerPort(server));
+	mutex.Unlock();
+	return protocolVersion;
+}
+
+bool RelayShard::GetSessionAddress(unsigned short id, SystemAddress *address)
+{
+	mutex.Lock();
+	bool found = relayState.GetSessionAddress(id, address);
+	mutex.Unlock();
+	return found;
+}
+
+unsigned short RelayShard::ReleaseServer(const SystemAddress &server)
+{
+	std::list<SystemAddress> users;
+	mutex.Lock();
+	unsigned short port = relayState.GetServerPort(server);
+	if (port != 0)
+	{
+		relayState.ReleasePort(port);
+		relayState.RemovePortUsers(port, users);
+	}
+	mutex.Unlock();
+
+	//MRB 8.27.12 -- disconnect any peers that were using this port
+	for (std::list<SystemAddress>::iterator i = users.begin(); i != users.end(); i++)
+	{
+		Log::debug_log("Disconnecting peer %s from port %d\n", i->ToString(), port);
+		peer->CloseConnection(*i, true);
+	}
+	return port;
+}
+
+int RelayShard::GetLoad()
+{
+	int load = -1;
+	mutex.Lock();
+	if (relayState.HasFreePort())
+		load = relayState.GetUsedPortCount() + relayState.GetPortUserCount();
+	mutex.Unlock();
+	return load;
+}
+
+void RelayShard::GetServerUsers(const SystemAddress &server, std::vector<SystemAddress> &users)
+{
+	mutex.Lock();
+	unsigned short port = relayState.GetServerPort(server);
+	if (port != 0)
+		relayState.GetPortUsers(port, users);
+	mutex.Unlock();
+}
+
+void RelayShard::HandlePacket(Packet *packet)
+{
+	mutex.Lock();
+	// DEBUG: Sanity check
+	if (!relayState.IsPortInUse(packet->rcvPort))
+	{
+		mutex.Unlock();
+		Log::error_log("Communication received on uninitialized server port %d\n", packet->rcvPort);
+		int IDlocation = 0;
+		if (packet->data[0] == ID_TIMESTAMP)
+			IDlocation = 5;
+		Log::error_log("Rejected message from client at %s, ID of message is %s\n", packet->systemAddress.ToString(), IDtoString(packet->data[IDlocation]));
+		return;
+	}
+
+	// Lookup target address from the port
+	SystemAddress targetAddress = relayState.GetPortServer(packet->rcvPort);
+	int protocolVersion = relayState.GetProtocolVersion(packet->rcvPort);
+
+	//MRB 8.27.12 -- keep track of who is using this port, add to our port user list on any new connections and remove from list on disconnects
+	if (packet->data[0] == ID_NEW_INCOMING_CONNECTION)
+	{
+		relayState.AddPortUser(packet->systemAddress, packet->rcvPort);
+		unsigned short sessionId = relayState.GetPortUserSession(packet->systemAddress);
+		mutex.Unlock();
+
+		// Batched like the messages which follow it, so the server cannot get them first
+		if (protocolVersion >= PROXY_SESSION_PROTOCOL_VERSION && sessionId != 0)
+		{
+			RakNet::BitStream init;
+			init.Write((unsigned char)ID_PROXY_SESSION_INIT);
+			init.Write(sessionId);
+			init.Write(packet->systemAddress);
+			if (!batcher.Add(mainPeer, targetAddress, 0, 0, init.GetData(), init.GetNumberOfBytesUsed(), RELIABLE_ORDERED, 0))
+				mainPeer->Send(&init, HIGH_PRIORITY, RELIABLE_ORDERED, 0, targetAddress, false);
+		}
+		return;
+	}
+
+	unsigned short sessionId = 0;
+	if (protocolVersion >= PROXY_SESSION_PROTOCOL_VERSION)
+		sessionId = relayState.GetPortUserSession(packet->systemAddress);
+
+	bool disconnected = false;
+	if (packet->data[0] == ID_DISCONNECTION_NOTIFICATION || packet->data[0] == ID_CONNECTION_LOST)
+	{
+		//MRB 8.27.12 -- peer is no longer using this port
+		relayState.RemovePortUser(packet->systemAddress);
+		disconnected = true;
+	}
+	mutex.Unlock();
+
+	if (disconnected)
+	{
+		// DEBUG
+		Log::print_log("%s has diconnected\n", packet->systemAddress.ToString());
+		DebugPrint();
+	}
+
+	if (Log::sDebugLevel >= kFullDebug)
+	{
+		char tmp[32];
+		strcpy(tmp, packet->systemAddress.ToString());
+		int IDlocation = 0;
+		if (packet->data[0] == ID_TIMESTAMP)
+			IDlocation = 5;
+		Log::debug_log("Relaying for client at %s, to server at %s, ID of relayed message is %s\n", tmp, targetAddress.ToString(), IDtoString(packet->data[IDlocation]));
+	}
+
+	// Now we need to prepend proxy message ID + sender address or session ID to original message
+	RakNet::BitStream header;
+	WriteRelayHeader(header, packet->systemAddress, sessionId);
+
+	if (protocolVersion >= PROXY_BATCH_PROTOCOL_VERSION && batcher.Add(mainPeer, targetAddress, (const char*)header.GetData(), header.GetNumberOfBytesUsed(), packet->data, packet->length, packet->reliability, packet->orderingChannel))
+		return;
+	Forward(peer, mainPeer, (const char*)header.GetData(), header.GetNumberOfBytesUsed(), packet, 0, packet->length, targetAddress);
+}
+
+void RelayShard::FlushBatches()
+{
+	batcher.Flush(mainPeer);
+}
+
+void RelayShard::DebugPrint()
+{
+	if (ownPeer)
+		Log::print_log("Ports %d to %d, connection count is %d\n", startPort, endPort, peer->NumberOfConnections());
+	if (Log::sDebugLevel != kInformational)
+		return;
+
+	mutex.Lock();
+	Log::print_log("Used ports: ");
+	relayState.PrintUsedPorts();
+	Log::print_log("Server ports: ");
+	relayState.PrintFreePorts();
+	Log::print_log("Server map: ");
+	relayState.PrintPortServers();
+	mutex.Unlock();
+}
+
+void RelayShard::Forward(RakPeerInterface *receiver, RakPeerInterface *sender, const char *header, int headerLength, Packet *packet, int payloadOffset, int payloadLength, const SystemAddress &target)
+{
+	if (payloadOffset < 0 || payloadLength < 0 || packet->length < (unsigned int)(payloadOffset + payloadLength))
+		return;
+
+	// Relay with the reliability and ordering channel the message arrived with, so unreliable traffic is not made reliable by the proxy
+	if (receiver == sender)
+	{
+		sender->SendWithHeader(header, headerLength, packet, payloadOffset, payloadLength, HIGH_PRIORITY, packet->reliability, packet->orderingChannel, target, false);
+		return;
+	}
+
+	RakNet::BitStream stream;
+	stream.WriteAlignedBytes((const unsigned char*)header, headerLength);
+	stream.WriteAlignedBytes(packet->data + payloadOffset, payloadLength);
+	sender->Send(&stream, HIGH_PRIORITY, packet->reliability, packet->orderingChannel, target, false);
+}
+
+void RelayShard::Multicast(RakPeerInterface *receiver, RakPeerInterface *sender, Packet *packet, int payloadOffset, int payloadLength, const std::vector<SystemAddress> &targets)
+{
+	if (targets.empty() || payloadOffset < 0 || payloadLength <= 0 || packet->length < (unsigned int)(payloadOffset + payloadLength))
+		return;
+
+	// The packet data belongs to the receiving peer, so give the sending peer one copy to share instead
+	Packet *shared = packet;
+	if (receiver != sender)
+	{
+		shared = sender->AllocatePacket(payloadLength);
+		memcpy(shared->data, packet->data + payloadOffset, payloadLength);
+		shared->reliability = packet->reliability;
+		shared->orderingChannel = packet->orderingChannel;
+		payloadOffset = 0;
+	}
+
+	for (std::vector<SystemAddress>::const_iterator i = targets.begin(); i != targets.end(); i++)
+		sender->SendWithHeader(0, 0, shared, payloadOffset, payloadLength, HIGH_PRIORITY, shared->reliability, shared->orderingChannel, *i, false);
+
+	if (shared != packet)
+		sender->DeallocatePacket(shared);
+}
+
+RAK_THREAD_DECLARATION(RelayShardLoop)
+{
+	RelayShard *shard = (RelayShard *) arguments;
+	RakPeerInterface *peer = shard->peer;
+
+	while (!shard->endThread)
+	{
+		Packet *packet;
+		while ((packet = peer->ReceiveIgnoreRPC()) != 0)
+		{
+			shard->HandlePacket(packet);
+			peer->DeallocatePacket(packet);
+		}
+		shard->FlushBatches();
+		peer->WaitForPacket(30);
+	}
+
+	shard->isThreadActive = false;
+	return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "RelayState.h"
+#include "RelayBatch.h"
+#include "SimpleMutex.h"
+#include "RakThread.h"
+
+class RakPeerInterface;
+struct Packet;
+
+// A slice of the relay ports, served by its own RakPeer and relay thread.
+//
+// Traffic on a relay port only involves the peers connected to that port and the server owning it, so the
+// relay port range can be split across several peers which each run their own network and relay threads. The
+// main peer keeps the listen port and the server connections, and hands out ports from the least loaded shard.
+//
+// Without a peer of its own the shard serves its ports from the main peer, and its packets are handled on the
+// main thread. This is the default, unsharded, mode.
+class RelayShard
+{
+public:
+	RelayShard();
+	~RelayShard();
+
+	// Shard served by the main peer, which is bound to the relay ports as well
+	void Startup(RakPeerInterface *mainPeer, unsigned short startPort, unsigned short endPort);
+	// Shard with its own peer bound to the relay ports, and its own relay thread. Returns false if the ports could not be bound
+	bool Startup(RakPeerInterface *mainPeer, unsigned short startPort, unsigned short endPort, int connectionCount, int receiveThreadCount, int updateThreadCount, const char *password, int passwordLength);
+	// Stops the relay thread, then the peer
+	void Shutdown();
+
+	RakPeerInterface* GetPeer() const { return peer; }
+	bool OwnsPort(unsigned short port) const { return port >= startPort && port <= endPort; }
+
+	// Called from the main thread
+	// Returns the assigned port, or 0 if none is free
+	unsigned short AssignPort(const SystemAddress &server, int protocolVersion);
+	// Proxy protocol version of a server with a port of this shard. 0 if the server has no port here
+	int GetProtocolVersion(const SystemAddress &server);
+	// Frees the port of this server and disconnects its users. Returns the freed port, or 0 if the server had none
+	unsigned short ReleaseServer(const SystemAddress &server);
+	// Assigned ports plus the peers connected to them. Returns -1 if there is no free port
+	int GetLoad();
+	// Appends the peers connected to the port of this server to users
+	void GetServerUsers(const SystemAddress &server, std::vector<SystemAddress> &users);
+	// Session IDs given to the peers connected to the ports of this shard. Set before the shard is used
+	void SetSessionRange(unsigned short firstId, unsigned short lastId) { relayState.SetSessionRange(firstId, lastId); }
+	bool OwnsSession(unsigned short id) const { return relayState.OwnsSession(id); }
+	// Returns false if the ID is not in use
+	bool GetSessionAddress(unsigned short id, SystemAddress *address);
+
+	// Relays a packet received on one of the ports of this shard to the port owner
+	void HandlePacket(Packet *packet);
+	// Sends the messages batched by HandlePacket. Called from the thread calling HandlePacket, once its packets are handled
+	void FlushBatches();
+	void DebugPrint();
+
+	// Sends payloadLength bytes of the message in packet, from payloadOffset on, behind the given header. Packets relayed through the peer which
+	// received them are sent without copying the message. Other peers copy it, as the packet data belongs to the receiving peer
+	static void Forward(RakPeerInterface *receiver, RakPeerInterface *sender, const char *header, int headerLength, Packet *packet, int payloadOffset, int payloadLength, const SystemAddress &target);
+	// Sends payloadLength bytes of the message in packet, from payloadOffset on, to every target. Every send shares one copy of the message, which is
+	// the packet data itself if the packet was received by sender
+	static void Multicast(RakPeerInterface *receiver, RakPeerInterface *sender, Packet *packet, int payloadOffset, int payloadLength, const std::vector<SystemAddress> &targets);
+
+private:
+	friend RAK_THREAD_DECLARATION(RelayShardLoop);
+
+	RakPeerInterface *peer;
+	RakPeerInterface *mainPeer;
+	bool ownPeer;
+	unsigned short startPort;
+	unsigned short endPort;
+
+	// Port owners and port users, guarded by mutex as the main thread assigns and releases ports
+	RelayState relayState;
+	SimpleMutex mutex;
+	// Relayed messages for servers accepting batches, only used by the thread handling the packets
+	RelayBatcher batcher;
+
+	volatile bool endThread;
+	volatile bool isThreadActive;
+};
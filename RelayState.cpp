@@ -0,0 +1,407 @@
+#include "RelayState.h"
+#include <stdio.h>
+#include <string.h>
+
+RelayState::RelayState()
+{
+	ports = 0;
+	startPort = 0;
+	portCount = 0;
+	sessions = 0;
+	firstSessionId = 0;
+	sessionCount = 0;
+}
+
+RelayState::~RelayState()
+{
+	unsigned int i;
+	for (i = 0; i < clients.SlotCount(); i++)
+		delete clients.GetSlot(i);
+	for (i = 0; i < servers.SlotCount(); i++)
+		delete servers.GetSlot(i);
+	for (i = 0; i < portUsers.SlotCount(); i++)
+		delete portUsers.GetSlot(i);
+	delete[] ports;
+	delete[] sessions;
+}
+
+void RelayState::SetPortRange(unsigned short start, unsigned short end)
+{
+	delete[] ports;
+	freePorts.clear();
+	startPort = start;
+	portCount = end >= start ? end - start + 1 : 0;
+	ports = new Port[portCount];
+	for (unsigned int i = 0; i < portCount; i++)
+	{
+		ports[i].server = UNASSIGNED_SYSTEM_ADDRESS;
+		ports[i].inUse = false;
+		ports[i].protocolVersion = 0;
+		ports[i].users = 0;
+		freePorts.push_back((unsigned short)(startPort + i));
+	}
+}
+
+RelayState::Port* RelayState::GetPort(unsigned short port) const
+{
+	if (port < startPort || (unsigned int)(port - startPort) >= portCount)
+		return 0;
+	return &ports[port - startPort];
+}
+
+unsigned short RelayState::AssignPort(const SystemAddress &server, int protocolVersion)
+{
+	Port *port = portOwners.Get(server);
+	if (port)
+	{
+		port->protocolVersion = protocolVersion;
+		return (unsigned short)(startPort + (port - ports));
+	}
+	if (freePorts.empty())
+		return 0;
+
+	unsigned short freePort = freePorts.front();
+	freePorts.pop_front();
+	port = GetPort(freePort);
+	port->server = server;
+	port->inUse = true;
+	port->protocolVersion = protocolVersion;
+	portOwners.Insert(server, port);
+	return freePort;
+}
+
+bool RelayState::ReleasePort(unsigned short portNumber)
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0 || !port->inUse)
+		return false;
+	portOwners.Remove(port->server);
+	port->server = UNASSIGNED_SYSTEM_ADDRESS;
+	port->inUse = false;
+	port->protocolVersion = 0;
+	freePorts.push_back(portNumber);
+	return true;
+}
+
+bool RelayState::IsPortInUse(unsigned short portNumber) const
+{
+	Port *port = GetPort(portNumber);
+	return port && port->inUse;
+}
+
+SystemAddress RelayState::GetPortServer(unsigned short portNumber) const
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0 || !port->inUse)
+		return UNASSIGNED_SYSTEM_ADDRESS;
+	return port->server;
+}
+
+unsigned short RelayState::GetServerPort(const SystemAddress &server) const
+{
+	Port *port = portOwners.Get(server);
+	if (port == 0)
+		return 0;
+	return (unsigned short)(startPort + (port - ports));
+}
+
+int RelayState::GetProtocolVersion(unsigned short portNumber) const
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0 || !port->inUse)
+		return 0;
+	return port->protocolVersion;
+}
+
+void RelayState::UnlinkPortUser(PortUser *user)
+{
+	if (user->prev)
+		user->prev->next = user->next;
+	else
+		GetPort(user->port)->users = user->next;
+	if (user->next)
+		user->next->prev = user->prev;
+}
+
+void RelayState::AddPortUser(const SystemAddress &address, unsigned short portNumber)
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0)
+		return;
+
+	PortUser *user = portUsers.Get(address);
+	if (user)
+		UnlinkPortUser(user);
+	else
+	{
+		user = new PortUser;
+		user->address = address;
+		user->sessionId = AddSession(address);
+		portUsers.Insert(address, user);
+	}
+	user->port = portNumber;
+	user->prev = 0;
+	user->next = port->users;
+	if (port->users)
+		port->users->prev = user;
+	port->users = user;
+}
+
+void RelayState::RemovePortUser(const SystemAddress &address)
+{
+	PortUser *user = portUsers.Remove(address);
+	if (user == 0)
+		return;
+	UnlinkPortUser(user);
+	RemoveSession(user->sessionId);
+	delete user;
+}
+
+void RelayState::RemovePortUsers(unsigned short portNumber, std::list<SystemAddress> &users)
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0)
+		return;
+	PortUser *user = port->users;
+	while (user)
+	{
+		PortUser *next = user->next;
+		users.push_back(user->address);
+		portUsers.Remove(user->address);
+		RemoveSession(user->sessionId);
+		delete user;
+		user = next;
+	}
+	port->users = 0;
+}
+
+void RelayState::GetPortUsers(unsigned short portNumber, std::vector<SystemAddress> &users) const
+{
+	Port *port = GetPort(portNumber);
+	if (port == 0)
+		return;
+	for (PortUser *user = port->users; user; user = user->next)
+		users.push_back(user->address);
+}
+
+RelayState::Server* RelayState::GetOrAddServer(const SystemAddress &address)
+{
+	Server *server = servers.Get(address);
+	if (server == 0)
+	{
+		server = new Server;
+		server->address = address;
+		server->clients = 0;
+		servers.Insert(address, server);
+	}
+	return server;
+}
+
+void RelayState::RemoveServerIfUnused(Server *server)
+{
+	if (server->clients == 0)
+	{
+		servers.Remove(server->address);
+		delete server;
+	}
+}
+
+void RelayState::UnlinkClient(Client *client)
+{
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		client->server->clients = client->next;
+	if (client->next)
+		client->next->prev = client->prev;
+}
+
+void RelayState::SetClientTarget(const SystemAddress &address, const SystemAddress &serverAddress)
+{
+	Client *client = clients.Get(address);
+	if (client)
+	{
+		if (client->server->address == serverAddress)
+			return;
+		UnlinkClient(client);
+		RemoveServerIfUnused(client->server);
+	}
+	else
+	{
+		client = new Client;
+		client->address = address;
+		client->sessionId = AddSession(address);
+		clients.Insert(address, client);
+	}
+
+	Server *server = GetOrAddServer(serverAddress);
+	client->server = server;
+	client->prev = 0;
+	client->next = server->clients;
+	if (server->clients)
+		server->clients->prev = client;
+	server->clients = client;
+}
+
+bool RelayState::GetClientTarget(const SystemAddress &address, SystemAddress *serverAddress) const
+{
+	Client *client = clients.Get(address);
+	if (client == 0)
+		return false;
+	*serverAddress = client->server->address;
+	return true;
+}
+
+bool RelayState::RemoveClient(const SystemAddress &address, SystemAddress *serverAddress)
+{
+	Client *client = clients.Remove(address);
+	if (client == 0)
+		return false;
+	*serverAddress = client->server->address;
+	UnlinkClient(client);
+	RemoveServerIfUnused(client->server);
+	RemoveSession(client->sessionId);
+	delete client;
+	return true;
+}
+
+bool RelayState::HasClients(const SystemAddress &serverAddress) const
+{
+	Server *server = servers.Get(serverAddress);
+	return server && server->clients;
+}
+
+bool RelayState::GetFirstClient(const SystemAddress &serverAddress, SystemAddress *clientAddress) const
+{
+	Server *server = servers.Get(serverAddress);
+	if (server == 0 || server->clients == 0)
+		return false;
+	*clientAddress = server->clients->address;
+	return true;
+}
+
+void RelayState::RemoveServerClients(const SystemAddress &serverAddress, std::list<SystemAddress> &removed)
+{
+	Server *server = servers.Get(serverAddress);
+	if (server == 0)
+		return;
+	Client *client = server->clients;
+	while (client)
+	{
+		Client *next = client->next;
+		removed.push_back(client->address);
+		clients.Remove(client->address);
+		RemoveSession(client->sessionId);
+		delete client;
+		client = next;
+	}
+	server->clients = 0;
+	RemoveServerIfUnused(server);
+}
+
+void RelayState::GetServerClients(const SystemAddress &serverAddress, std::vector<SystemAddress> &result) const
+{
+	Server *server = servers.Get(serverAddress);
+	if (server == 0)
+		return;
+	for (Client *client = server->clients; client; client = client->next)
+		result.push_back(client->address);
+}
+
+void RelayState::SetSessionRange(unsigned short firstId, unsigned short lastId)
+{
+	delete[] sessions;
+	freeSessions.clear();
+	// 0 means no session
+	if (firstId == 0)
+		firstId = 1;
+	firstSessionId = firstId;
+	sessionCount = lastId >= firstId ? lastId - firstId + 1 : 0;
+	sessions = new SystemAddress[sessionCount];
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		sessions[i] = UNASSIGNED_SYSTEM_ADDRESS;
+		freeSessions.push_back((unsigned short)(firstSessionId + i));
+	}
+}
+
+unsigned short RelayState::AddSession(const SystemAddress &address)
+{
+	if (freeSessions.empty())
+		return 0;
+	unsigned short id = freeSessions.front();
+	freeSessions.pop_front();
+	sessions[id - firstSessionId] = address;
+	return id;
+}
+
+void RelayState::RemoveSession(unsigned short id)
+{
+	if (id == 0 || !OwnsSession(id))
+		return;
+	sessions[id - firstSessionId] = UNASSIGNED_SYSTEM_ADDRESS;
+	freeSessions.push_back(id);
+}
+
+unsigned short RelayState::GetClientSession(const SystemAddress &address) const
+{
+	Client *client = clients.Get(address);
+	return client ? client->sessionId : 0;
+}
+
+unsigned short RelayState::GetPortUserSession(const SystemAddress &address) const
+{
+	PortUser *user = portUsers.Get(address);
+	return user ? user->sessionId : 0;
+}
+
+bool RelayState::GetSessionAddress(unsigned short id, SystemAddress *address) const
+{
+	if (!OwnsSession(id) || sessions[id - firstSessionId] == UNASSIGNED_SYSTEM_ADDRESS)
+		return false;
+	*address = sessions[id - firstSessionId];
+	return true;
+}
+
+void RelayState::PrintUsedPorts() const
+{
+	for (unsigned int i = 0; i < portCount; i++)
+	{
+		if (ports[i].inUse)
+			printf("%d ", startPort + i);
+	}
+	printf("\n");
+}
+
+void RelayState::PrintFreePorts() const
+{
+	for (std::deque<unsigned short>::const_iterator i = freePorts.begin(); i != freePorts.end(); i++)
+		printf("%d ", *i);
+	printf("\n");
+}
+
+void RelayState::PrintPortServers() const
+{
+	for (unsigned int i = 0; i < portCount; i++)
+	{
+		if (ports[i].inUse)
+			printf("[%d %s] ", startPort + i, ports[i].server.ToString());
+	}
+	printf("\n");
+}
+
+void RelayState::PrintClients() const
+{
+	for (unsigned int i = 0; i < clients.SlotCount(); i++)
+	{
+		Client *client = clients.GetSlot(i);
+		if (client)
+		{
+			// ToString uses a static buffer
+			char tmp[32];
+			strcpy(tmp, client->address.ToString());
+			printf("[%s %s] ", tmp, client->server->address.ToString());
+		}
+	}
+	printf("\n");
+}
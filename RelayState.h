@@ -0,0 +1,241 @@
+#pragma once
+#include "RakNetTypes.h"
+#include <deque>
+#include <list>
+#include <vector>
+
+// Open addressing hash table from SystemAddress to a record, using linear probing.
+// Records are owned by the caller, the table only stores the pointers.
+template <class Record>
+class AddressTable
+{
+public:
+	AddressTable() : slots(0), capacity(0), count(0) {}
+	~AddressTable() { delete[] slots; }
+
+	Record* Get(const SystemAddress &address) const
+	{
+		if (count == 0)
+			return 0;
+		for (unsigned int i = Hash(address) & (capacity-1); slots[i].record; i = (i+1) & (capacity-1))
+		{
+			if (slots[i].address == address)
+				return slots[i].record;
+		}
+		return 0;
+	}
+
+	// Address must not already be in the table
+	void Insert(const SystemAddress &address, Record *record)
+	{
+		// Keep the load factor under 1/2 so probe sequences stay short
+		if ((count+1)*2 > capacity)
+			Grow();
+		unsigned int i = Hash(address) & (capacity-1);
+		while (slots[i].record)
+			i = (i+1) & (capacity-1);
+		slots[i].address = address;
+		slots[i].record = record;
+		count++;
+	}
+
+	Record* Remove(const SystemAddress &address)
+	{
+		if (count == 0)
+			return 0;
+		unsigned int i = Hash(address) & (capacity-1);
+		while (slots[i].record && slots[i].address != address)
+			i = (i+1) & (capacity-1);
+		Record *record = slots[i].record;
+		if (record == 0)
+			return 0;
+
+		// Shift later entries of the probe sequence back, so no tombstones are needed
+		unsigned int hole = i;
+		for (unsigned int j = (i+1) & (capacity-1); slots[j].record; j = (j+1) & (capacity-1))
+		{
+			unsigned int home = Hash(slots[j].address) & (capacity-1);
+			if (((j - home) & (capacity-1)) >= ((j - hole) & (capacity-1)))
+			{
+				slots[hole] = slots[j];
+				hole = j;
+			}
+		}
+		slots[hole].record = 0;
+		count--;
+		return record;
+	}
+
+	unsigned int Size() const { return count; }
+
+	// For iterating over every record, such as when printing debug output. Empty slots return 0
+	unsigned int SlotCount() const { return capacity; }
+	Record* GetSlot(unsigned int i) const { return slots[i].record; }
+
+private:
+	struct Slot
+	{
+		Slot() : record(0) {}
+		SystemAddress address;
+		Record *record;
+	};
+
+	static unsigned int Hash(const SystemAddress &address)
+	{
+		unsigned int h = address.binaryAddress ^ ((unsigned int)address.port << 16) ^ address.port;
+		h ^= h >> 16;
+		h *= 0x45d9f3b;
+		h ^= h >> 16;
+		return h;
+	}
+
+	void Grow()
+	{
+		Slot *oldSlots = slots;
+		unsigned int oldCapacity = capacity;
+		capacity = capacity ? capacity*2 : 64;
+		slots = new Slot[capacity];
+		count = 0;
+		for (unsigned int i = 0; i < oldCapacity; i++)
+		{
+			if (oldSlots[i].record)
+				Insert(oldSlots[i].address, oldSlots[i].record);
+		}
+		delete[] oldSlots;
+	}
+
+	Slot *slots;
+	unsigned int capacity;
+	unsigned int count;
+};
+
+// Connection tracking for the proxy.
+//
+// Clients connecting on the listen port name a target server (ID_PROXY_INIT_MESSAGE). Each such client is
+// linked into the list of clients of its server, so cleaning up after a server only touches its own clients.
+//
+// Servers registering with ID_PROXY_SERVER_INIT are given one of the relay ports. Ports are stored in a flat
+// array indexed by port number, and each port keeps the list of peers connected to it.
+class RelayState
+{
+public:
+	RelayState();
+	~RelayState();
+
+	// Range of relay ports handed out to servers, inclusive
+	void SetPortRange(unsigned short startPort, unsigned short endPort);
+
+	// Relay ports. Returns the assigned port, or 0 if none is free. A server which already has a port gets the same one again
+	unsigned short AssignPort(const SystemAddress &server, int protocolVersion);
+	// Returns false if the port was not in use
+	bool ReleasePort(unsigned short port);
+	bool IsPortInUse(unsigned short port) const;
+	// Returns UNASSIGNED_SYSTEM_ADDRESS if the port is not in use
+	SystemAddress GetPortServer(unsigned short port) const;
+	// Returns 0 if the server was not assigned a port
+	unsigned short GetServerPort(const SystemAddress &server) const;
+	// Proxy protocol version the server owning the port announced in ID_PROXY_SERVER_INIT, or 0 if the port is not in use
+	int GetProtocolVersion(unsigned short port) const;
+	unsigned int GetUsedPortCount() const { return portOwners.Size(); }
+	bool HasFreePort() const { return !freePorts.empty(); }
+
+	// Peers connected to a relay port. A peer has a single connection, so adding it again moves it to the new port
+	void AddPortUser(const SystemAddress &user, unsigned short port);
+	void RemovePortUser(const SystemAddress &user);
+	// Removes every peer connected to this port, and appends them to users
+	void RemovePortUsers(unsigned short port, std::list<SystemAddress> &users);
+	// Appends every peer connected to this port to users
+	void GetPortUsers(unsigned short port, std::vector<SystemAddress> &users) const;
+	unsigned int GetPortUserCount() const { return portUsers.Size(); }
+
+	// Client relays. Setting the target of a client which already has one moves it to the new server
+	void SetClientTarget(const SystemAddress &client, const SystemAddress &server);
+	bool GetClientTarget(const SystemAddress &client, SystemAddress *server) const;
+	// Returns false if the client had no target
+	bool RemoveClient(const SystemAddress &client, SystemAddress *server);
+	bool HasClients(const SystemAddress &server) const;
+	bool GetFirstClient(const SystemAddress &server, SystemAddress *client) const;
+	// Removes every client relaying to this server, and appends them to clients
+	void RemoveServerClients(const SystemAddress &server, std::list<SystemAddress> &clients);
+	// Appends every client relaying to this server to clients
+	void GetServerClients(const SystemAddress &server, std::vector<SystemAddress> &clients) const;
+
+	// Session IDs, see PROXY_SESSION_PROTOCOL_VERSION. Clients and port users are given an ID from this range when they are added,
+	// if one is free. IDs are indices into a flat array, and freed IDs are reused last
+	void SetSessionRange(unsigned short firstId, unsigned short lastId);
+	bool OwnsSession(unsigned short id) const { return id >= firstSessionId && (unsigned int)(id - firstSessionId) < sessionCount; }
+	// Return 0 if the peer has no session ID
+	unsigned short GetClientSession(const SystemAddress &client) const;
+	unsigned short GetPortUserSession(const SystemAddress &user) const;
+	// Returns false if the ID is not in use
+	bool GetSessionAddress(unsigned short id, SystemAddress *address) const;
+
+	// Debug output, printed to stdout like the rest of the relay debug output
+	void PrintUsedPorts() const;
+	void PrintFreePorts() const;
+	void PrintPortServers() const;
+	void PrintClients() const;
+
+private:
+	struct Server;
+
+	struct Client
+	{
+		SystemAddress address;
+		unsigned short sessionId;
+		Server *server;
+		Client *prev;
+		Client *next;
+	};
+
+	// A server which clients relay to
+	struct Server
+	{
+		SystemAddress address;
+		Client *clients;
+	};
+
+	struct PortUser
+	{
+		SystemAddress address;
+		unsigned short sessionId;
+		unsigned short port;
+		PortUser *prev;
+		PortUser *next;
+	};
+
+	struct Port
+	{
+		SystemAddress server;
+		bool inUse;
+		int protocolVersion;
+		PortUser *users;
+	};
+
+	Port* GetPort(unsigned short port) const;
+	Server* GetOrAddServer(const SystemAddress &address);
+	void RemoveServerIfUnused(Server *server);
+	void UnlinkClient(Client *client);
+	void UnlinkPortUser(PortUser *user);
+	// Returns 0 if no ID is free
+	unsigned short AddSession(const SystemAddress &address);
+	void RemoveSession(unsigned short id);
+
+	AddressTable<Client> clients;
+	AddressTable<Server> servers;
+	AddressTable<PortUser> portUsers;
+	// Server address to its relay port
+	AddressTable<Port> portOwners;
+
+	Port *ports;
+	unsigned short startPort;
+	unsigned int portCount;
+	// Add to the back when freed, so a port is less likely to be reused immediately
+	std::deque<unsigned short> freePorts;
+
+	// Address of each session ID, UNASSIGNED_SYSTEM_ADDRESS if the ID is free
+	SystemAddress *sessions;
+	unsigned short firstSessionId;
+	unsigned int sessionCount;
+	std::deque<unsigned short> freeSessions;
+};